@@ -0,0 +1,298 @@
+// Front end throughput benchmark: generates a synthetic Lox source and times
+// scanner_scan, parser_parse and resolver_resolve separately. With --edits it
+// also times incremental_edit for single character edits at random places.
+//
+//   lox_frontend_bench [--size=MB] [--shape=mixed|nesting|functions|strings]
+//                      [--depth=N] [--iterations=N] [--threads=N] [--edits=N]
+
+#include "scanner.h"
+#include "parser.h"
+#include "resolver.h"
+#include "incremental.h"
+#include "optimizer.h"
+#include "source.h"
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+static std::atomic<size_t> g_bytesAllocated(0);
+
+void* operator new(size_t size)
+{
+    g_bytesAllocated += size;
+    if (void* ptr = malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+enum class Shape
+{
+    Mixed, Nesting, Functions, Strings
+};
+
+struct Options
+{
+    double sizeMB = 8.0;
+    Shape shape = Shape::Mixed;
+    int depth = 64;
+    int iterations = 3;
+    int threads = 0;
+    int edits = 0;
+};
+
+static void AppendNesting(std::string& out, int id, int depth)
+{
+    out += "var nest" + std::to_string(id) + " = ";
+    for (int i = 0; i < depth; ++i)
+        out += (i & 1) ? "(" + std::to_string(i) + " * " : "(" + std::to_string(i) + " + ";
+    out += "1";
+    for (int i = 0; i < depth; ++i)
+        out += ")";
+    out += ";\n";
+}
+
+static void AppendFunction(std::string& out, int id)
+{
+    std::string n = std::to_string(id);
+    out += "fun func" + n + "(a, b, c) {\n"
+        "    var sum = a + b * " + n + " - c;\n"
+        "    if (sum > 100 and a < 5 or b == 3) { return sum; }\n"
+        "    while (sum < 10) sum = sum + 1;\n"
+        "    fun inner() { return sum + a; }\n"
+        "    return inner();\n"
+        "}\n";
+}
+
+static void AppendString(std::string& out, int id)
+{
+    out += "var text" + std::to_string(id) + " = \"";
+    for (int i = 0; i < 8; ++i)
+        out += "a long string literal body of generated report text, ";
+    out += "\";\n";
+}
+
+static std::string Generate(const Options& options)
+{
+    size_t target = (size_t)(options.sizeMB * 1024 * 1024);
+    std::string out;
+    out.reserve(target + 4096);
+    for (int id = 0; out.size() < target; ++id)
+    {
+        switch (options.shape)
+        {
+            case Shape::Nesting: AppendNesting(out, id, options.depth); break;
+            case Shape::Functions: AppendFunction(out, id); break;
+            case Shape::Strings: AppendString(out, id); break;
+            case Shape::Mixed:
+                switch (id % 3)
+                {
+                    case 0: AppendNesting(out, id, options.depth); break;
+                    case 1: AppendFunction(out, id); break;
+                    case 2: AppendString(out, id); break;
+                }
+                break;
+        }
+    }
+    return out;
+}
+
+struct PhaseStats
+{
+    double seconds = 0.0;
+    size_t bytes = 0;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void Report(const char* phase, const PhaseStats& stats, size_t items, const char* unit, int iterations)
+{
+    double seconds = stats.seconds / iterations;
+    printf("%-8s %9.2f ms %10.2f M%s/s %12.1f KB allocated\n", phase, seconds * 1000.0,
+        items / seconds / 1e6, unit, stats.bytes / iterations / 1024.0);
+}
+
+// Digits inside identifiers are skipped: editing them could declare a global twice
+static bool IsLiteralDigit(const std::string& text, int pos)
+{
+    if (text[pos] < '0' || text[pos] > '9')
+        return false;
+    while (pos > 0 && text[pos - 1] >= '0' && text[pos - 1] <= '9')
+        --pos;
+    return pos == 0 || !(isalpha((unsigned char)text[pos - 1]) || text[pos - 1] == '_');
+}
+
+static bool CompileFull(const std::string& text)
+{
+    std::vector<Token> tokens;
+    Arena arena;
+    StmtPtrList stmts;
+    scanner_scan(text.c_str(), (int)text.size(), tokens);
+    bool compiled = parser_parse(tokens, arena, stmts) && resolver_resolve(stmts);
+    source_remove(tokens.back().start);
+    return compiled;
+}
+
+// The document compiled after every timed edit, so the whole text must too.
+// Then the first declaration is copied to the end of the document and removed
+// again, and the incremental result must agree with compiling the whole text.
+static bool CheckEdits(IncrementalDocument& doc)
+{
+    if (!CompileFull(doc.text))
+        return false;
+    std::string copy = doc.text.substr(doc.decls[0]->begin, doc.decls[0]->end - doc.decls[0]->begin) + "\n";
+    int end = (int)doc.text.size();
+    bool added = incremental_edit(doc, end, end, copy.c_str(), (int)copy.size());
+    if (added != CompileFull(doc.text))
+        return false;
+    bool removed = incremental_edit(doc, end, end + (int)copy.size(), "", 0);
+    return removed == CompileFull(doc.text);
+}
+
+// Replaces random digits of number literals, so every edit keeps the program valid
+static int BenchEdits(const std::string& source, int edits)
+{
+    IncrementalDocument doc;
+    Clock::time_point start = Clock::now();
+    incremental_open(doc, source.c_str(), (int)source.size());
+    printf("open     %9.2f ms %10zu declarations\n", Seconds(start) * 1000.0, doc.decls.size());
+
+    // Replacing a digit keeps the length, so the positions stay valid across edits
+    std::vector<int> digits;
+    for (int pos = 0; pos < (int)doc.text.size(); ++pos)
+        if (IsLiteralDigit(doc.text, pos))
+            digits.push_back(pos);
+    if (digits.empty())
+    {
+        printf("edit     no number literals to edit\n");
+        edits = 0;
+    }
+
+    srand(1);
+    double total = 0.0, worst = 0.0;
+    for (int i = 0; i < edits; ++i)
+    {
+        int pos = digits[((size_t)rand() * RAND_MAX + rand()) % digits.size()];
+        char digit = (char)('1' + rand() % 9);
+        start = Clock::now();
+        bool compiled = incremental_edit(doc, pos, pos + 1, &digit, 1);
+        double seconds = Seconds(start);
+        total += seconds;
+        worst = seconds > worst ? seconds : worst;
+        if (!compiled)
+        {
+            printf("Edited source failed to compile\n");
+            return 1;
+        }
+    }
+    if (edits > 0)
+        printf("edit     %9.3f ms mean %9.3f ms worst over %d edits\n", total / edits * 1000.0, worst * 1000.0, edits);
+
+    if (!CheckEdits(doc))
+    {
+        printf("Incremental errors differ from a full compile\n");
+        return 1;
+    }
+    return 0;
+}
+
+static bool ParseArg(const char* arg, const char* name, const char*& value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    value = arg + len + 1;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* value;
+        if (ParseArg(argv[i], "--size", value)) options.sizeMB = atof(value);
+        else if (ParseArg(argv[i], "--depth", value)) options.depth = atoi(value);
+        else if (ParseArg(argv[i], "--iterations", value)) options.iterations = atoi(value);
+        else if (ParseArg(argv[i], "--threads", value)) options.threads = atoi(value);
+        else if (ParseArg(argv[i], "--edits", value)) options.edits = atoi(value);
+        else if (ParseArg(argv[i], "--shape", value))
+        {
+            if (strcmp(value, "mixed") == 0) options.shape = Shape::Mixed;
+            else if (strcmp(value, "nesting") == 0) options.shape = Shape::Nesting;
+            else if (strcmp(value, "functions") == 0) options.shape = Shape::Functions;
+            else if (strcmp(value, "strings") == 0) options.shape = Shape::Strings;
+            else
+            {
+                printf("Unknown shape %s\n", value);
+                return 1;
+            }
+        }
+        else
+        {
+            printf("usage: %s [--size=MB] [--shape=mixed|nesting|functions|strings] [--depth=N] [--iterations=N] [--threads=N] [--edits=N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (options.iterations < 1)
+        options.iterations = 1;
+
+    const std::string source = Generate(options);
+    printf("source   %9.2f MB\n", source.size() / (1024.0 * 1024.0));
+
+    PhaseStats scan, parse, resolve;
+    size_t tokenCount = 0, nodeCount = 0;
+    for (int i = 0; i < options.iterations; ++i)
+    {
+        std::vector<Token> tokens;
+        size_t bytes = g_bytesAllocated;
+        Clock::time_point start = Clock::now();
+        scanner_scan(source.c_str(), (int)source.size(), tokens, options.threads);
+        scan.seconds += Seconds(start);
+        scan.bytes += g_bytesAllocated - bytes;
+        tokenCount = tokens.size();
+
+        Arena arena;
+        StmtPtrList stmts;
+        bytes = g_bytesAllocated;
+        start = Clock::now();
+        bool parsed = parser_parse(tokens, arena, stmts, options.threads);
+        parse.seconds += Seconds(start);
+        parse.bytes += g_bytesAllocated - bytes + arena.BytesAllocated();
+
+        bytes = g_bytesAllocated;
+        start = Clock::now();
+        bool resolved = parsed && resolver_resolve(stmts);
+        resolve.seconds += Seconds(start);
+        resolve.bytes += g_bytesAllocated - bytes;
+        if (!resolved)
+        {
+            printf("Generated source failed to compile\n");
+            return 1;
+        }
+
+        nodeCount = optimizer_count_nodes(stmts);
+        source_remove(tokens.back().start);
+    }
+
+    printf("tokens   %9zu\nnodes    %9zu\n", tokenCount, nodeCount);
+    Report("scan", scan, tokenCount, "tokens", options.iterations);
+    Report("parse", parse, nodeCount, "nodes", options.iterations);
+    Report("resolve", resolve, nodeCount, "nodes", options.iterations);
+    return options.edits > 0 ? BenchEdits(source, options.edits) : 0;
+}
@@ -0,0 +1,64 @@
+#include "arena.h"
+#include <cstdlib>
+
+// Blocks start small and double up to the maximum, so the many small arenas
+// (REPL lines, incrementally compiled declarations) stay small
+static const size_t ArenaFirstBlockSize = 1024;
+static const size_t ArenaBlockSize = 64 * 1024;
+
+Arena::Arena()
+    : m_block(nullptr)
+    , m_used(0)
+    , m_blockSize(0)
+    , m_nextBlockSize(ArenaFirstBlockSize)
+    , m_bytesAllocated(0)
+{}
+
+Arena::~Arena()
+{
+    Reset();
+}
+
+void Arena::Reset()
+{
+    for (char* block : m_blocks)
+        free(block);
+    m_blocks.clear();
+    m_block = nullptr;
+    m_used = m_blockSize = 0;
+    m_nextBlockSize = ArenaFirstBlockSize;
+}
+
+void Arena::Adopt(Arena& other)
+{
+    m_blocks.insert(m_blocks.end(), other.m_blocks.begin(), other.m_blocks.end());
+    m_bytesAllocated += other.m_bytesAllocated;
+    other.m_blocks.clear();
+    other.m_block = nullptr;
+    other.m_used = other.m_blockSize = 0;
+    other.m_nextBlockSize = ArenaFirstBlockSize;
+    other.m_bytesAllocated = 0;
+}
+
+void* Arena::AllocateSlow(size_t size, size_t align)
+{
+    // oversized requests get a block of their own so the current block keeps filling
+    size_t blockSize = size + align > m_nextBlockSize ? size + align : m_nextBlockSize;
+    char* block = static_cast<char*>(malloc(blockSize));
+    if (!block)
+        throw std::bad_alloc();
+    m_blocks.push_back(block);
+    m_bytesAllocated += blockSize;
+
+    size_t offset = ((size_t)block + align - 1) & ~(align - 1);
+    offset -= (size_t)block;
+    if (blockSize != m_nextBlockSize)
+        return block + offset;
+
+    if (m_nextBlockSize < ArenaBlockSize)
+        m_nextBlockSize *= 2;
+    m_block = block;
+    m_blockSize = blockSize;
+    m_used = offset + size;
+    return block + offset;
+}
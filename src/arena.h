@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Fixed length array living in an Arena. Like everything else allocated from
+// an Arena it is never destructed, so T must be trivially destructible.
+template <typename T> struct ArenaList
+{
+    ArenaList()
+        : items(nullptr)
+        , count(0)
+    {}
+    ArenaList(T* items, int count)
+        : items(items)
+        , count(count)
+    {}
+
+    T* begin() const { return items; }
+    T* end() const { return items + count; }
+    size_t size() const { return (size_t)count; }
+    bool empty() const { return count == 0; }
+    T& operator[](int idx) const { return items[idx]; }
+
+    T* items;
+    int count;
+};
+
+// Bump pointer allocator. Memory is only released all at once when the arena
+// is destroyed, and destructors of the objects allocated from it are never run.
+class Arena
+{
+public:
+    Arena();
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size, size_t align)
+    {
+        size_t offset = (m_used + align - 1) & ~(align - 1);
+        if (offset + size > m_blockSize)
+            return AllocateSlow(size, align);
+        m_used = offset + size;
+        return m_block + offset;
+    }
+
+    template <typename T, typename... Args> T* New(Args&&... args)
+    {
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T> ArenaList<T> NewList(const std::vector<T>& items)
+    {
+        if (items.empty())
+            return ArenaList<T>();
+        T* copy = static_cast<T*>(Allocate(sizeof(T) * items.size(), alignof(T)));
+        for (size_t i = 0; i < items.size(); ++i)
+            new (copy + i) T(items[i]);
+        return ArenaList<T>(copy, (int)items.size());
+    }
+
+    // Releases everything allocated so far
+    void Reset();
+
+    // Takes ownership of everything allocated from other, leaving it empty
+    void Adopt(Arena& other);
+
+    size_t BytesAllocated() const { return m_bytesAllocated; }
+
+private:
+    void* AllocateSlow(size_t size, size_t align);
+
+    char* m_block;
+    size_t m_used, m_blockSize, m_nextBlockSize, m_bytesAllocated;
+    std::vector<char*> m_blocks;
+};
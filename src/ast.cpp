@@ -1,4 +0,0 @@
-#include "ast.h"
-
-Expr::~Expr() {}
-Stmt::~Stmt() {}
\ No newline at end of file
@@ -1,29 +1,37 @@
 #pragma once
 #include "scanner.h"
-#include <array>
-#include <memory>
+#include "arena.h"
+#include <cstdint>
 
 enum class ExprType
 {
-    Assign, Binary, Call, Grouping, Literal, Logical, Unary, Variable
+    Assign, Binary, Call, Get, Grouping, Literal, Logical, Set, Unary, Variable
 };
 
+// AST nodes are allocated from the compilation unit's Arena and are never
+// destructed, so they must stay trivially destructible.
 struct Expr
 {
     ExprType type;
-    virtual ~Expr();
 };
 
+// The resolver binds each variable reference to where its variable lives.
+// Locals only used by their own function are slot idx of the function's frame
+// on the interpreter's value stack (StackVariable). Locals captured by a
+// closure are slot idx of a heap environment depth environments out, and
+// globals are global slot idx.
 const int GlobalVariable = -1;
-typedef std::unique_ptr<Expr> ExprPtr;
-typedef std::vector<std::unique_ptr<Expr>> ExprPtrList;
+const int StackVariable = -2;
+typedef Expr* ExprPtr;
+typedef ArenaList<ExprPtr> ExprPtrList;
 
 struct ExprAssign : public Expr
 {
-    ExprAssign(const Token* name, ExprPtr&& value)
+    ExprAssign(const Token* name, ExprPtr value)
         : name(name)
-        , value(std::move(value))
+        , value(value)
         , depth(GlobalVariable)
+        , idx(0)
     {
         type = ExprType::Assign;
     }
@@ -32,12 +40,40 @@ struct ExprAssign : public Expr
     int depth, idx;
 };
 
+// Operator nodes specialize themselves the first time the tree walker
+// evaluates them, on the operand types it saw. A specialized node checks its
+// guard and skips the generic operator code; when the guard fails it falls
+// back to Generic for good.
+enum class BinaryQuick : uint8_t
+{
+    Uninitialized, Generic,
+    // both operands numbers
+    AddInt, SubtractInt, MultiplyInt, GreaterInt, GreaterEqualInt, LessInt, LessEqualInt,
+    // left operand a number, right operand an integer literal
+    AddIntLiteral, SubtractIntLiteral, MultiplyIntLiteral, GreaterIntLiteral, GreaterEqualIntLiteral, LessIntLiteral, LessEqualIntLiteral,
+    ConcatString// + on two strings
+};
+
+enum class UnaryQuick : uint8_t
+{
+    Uninitialized, Generic,
+    NegateInt,
+    Not// needs no guard
+};
+
+enum class LogicalQuick : uint8_t
+{
+    Uninitialized, Generic,
+    AndBool, OrBool// left operand a bool
+};
+
 struct ExprBinary : public Expr
 {
-    ExprBinary(ExprPtr&& left, const Token* op, ExprPtr&& right)
-        : left(std::move(left))
+    ExprBinary(ExprPtr left, const Token* op, ExprPtr right)
+        : left(left)
         , op(op)
-        , right(std::move(right))
+        , right(right)
+        , quick(BinaryQuick::Uninitialized)
     {
         type = ExprType::Binary;
     }
@@ -45,14 +81,16 @@ struct ExprBinary : public Expr
     ExprPtr left;
     const Token* op;
     ExprPtr right;
+    mutable BinaryQuick quick;
 };
 
 struct ExprCall : public Expr
 {
-    ExprCall(ExprPtr&& callee, const Token* paren, ExprPtrList&& args)
-        : callee(std::move(callee))
+    ExprCall(ExprPtr callee, const Token* paren, const ExprPtrList& args)
+        : callee(callee)
         , paren(paren)
-        , args(std::move(args))
+        , args(args)
+        , arityChecked(0)
     {
         type = ExprType::Call;
     }
@@ -60,12 +98,80 @@ struct ExprCall : public Expr
     ExprPtr callee;
     const Token* paren;
     ExprPtrList args;
+    int arityChecked;// 1 if the resolver proved the callee is a function taking args.size() arguments
+};
+
+// Inline cache of a property access: the field slot it found for each of the
+// last few instance shapes it saw, so the next access on an instance of one of
+// those shapes is a pointer compare and an indexed load. A set that added the
+// field also records the shape the instance moved to. Once full, accesses on
+// other shapes look the field up without caching it.
+struct LoxShape;
+const int PropertyCacheSize = 4;
+
+struct PropertyCache
+{
+    struct Entry
+    {
+        LoxShape* shape;
+        LoxShape* next;// shape after a set, shape itself if the field was there
+        int slot;
+    };
+
+    const Entry* Find(const LoxShape* shape) const
+    {
+        for (int i = 0; i < count; ++i)
+            if (entries[i].shape == shape)
+                return &entries[i];
+        return nullptr;
+    }
+
+    void Add(LoxShape* shape, LoxShape* next, int slot)
+    {
+        if (count < PropertyCacheSize)
+            entries[count++] = Entry{ shape, next, slot };
+    }
+
+    Entry entries[PropertyCacheSize];
+    int count;
+};
+
+struct ExprGet : public Expr
+{
+    ExprGet(ExprPtr object, const Token* name)
+        : object(object)
+        , name(name)
+        , cache()
+    {
+        type = ExprType::Get;
+    }
+
+    ExprPtr object;
+    const Token* name;
+    mutable PropertyCache cache;
+};
+
+struct ExprSet : public Expr
+{
+    ExprSet(ExprPtr object, const Token* name, ExprPtr value)
+        : object(object)
+        , name(name)
+        , value(value)
+        , cache()
+    {
+        type = ExprType::Set;
+    }
+
+    ExprPtr object;
+    const Token* name;
+    ExprPtr value;
+    mutable PropertyCache cache;
 };
 
 struct ExprGrouping : public Expr
 {
-    ExprGrouping(ExprPtr&& expr)
-        : expr(std::move(expr))
+    ExprGrouping(ExprPtr expr)
+        : expr(expr)
     {
         type = ExprType::Grouping;
     }
@@ -83,59 +189,72 @@ struct ExprLiteral : public Expr
     explicit ExprLiteral(bool value)
         : litType(LitType::Bool)
         , intValue(value)
+        , stringValue(nullptr)
+        , offset(0)
     {
         type = ExprType::Literal;
     }
     explicit ExprLiteral(int value)
         : litType(LitType::Int)
         , intValue(value)
+        , stringValue(nullptr)
+        , offset(0)
     {
         type = ExprType::Literal;   
     }
-    explicit ExprLiteral(const std::string& value)
+    // string literals point straight at their characters in the source buffer
+    ExprLiteral(const char* value, int length, int offset)
         : litType(LitType::String)
-        , intValue(0)
+        , intValue(length)
         , stringValue(value)
+        , offset(offset)
     {
         type = ExprType::Literal;
     }
     ExprLiteral()
         : litType(LitType::Nil)
         , intValue(0)
+        , stringValue(nullptr)
+        , offset(0)
     {
         type = ExprType::Literal;
     }
 
     LitType litType;
-    int intValue;
-    std::string stringValue;
+    int intValue;// length of stringValue for string literals
+    const char* stringValue;
+    int offset;// of stringValue as registered with source_add, see source.h
 };
 
 struct ExprLogical : public Expr
 {
-    ExprLogical(ExprPtr&& left, const Token* op, ExprPtr&& right)
-        : left(std::move(left))
-        , right(std::move(right))
+    ExprLogical(ExprPtr left, const Token* op, ExprPtr right)
+        : left(left)
+        , right(right)
         , op(op)
+        , quick(LogicalQuick::Uninitialized)
     {
         type = ExprType::Logical;   
     }
 
     ExprPtr left, right;
     const Token* op;
+    mutable LogicalQuick quick;
 };
 
 struct ExprUnary : public Expr
 {
-    ExprUnary(const Token* op, ExprPtr&& right)
-        : right(std::move(right))
+    ExprUnary(const Token* op, ExprPtr right)
+        : right(right)
         , op(op)
+        , quick(UnaryQuick::Uninitialized)
     {
         type = ExprType::Unary;   
     }
 
     ExprPtr right;
     const Token* op;
+    mutable UnaryQuick quick;
 };
 
 struct ExprVariable : public Expr
@@ -143,6 +262,7 @@ struct ExprVariable : public Expr
     ExprVariable(const Token* name)
         : name(name)
         , depth(GlobalVariable)
+        , idx(0)
     {
         type = ExprType::Variable;   
     }
@@ -159,27 +279,30 @@ enum class StmtType
 struct Stmt
 {
     StmtType type;
-    virtual ~Stmt();
 };
 
-typedef std::unique_ptr<Stmt> StmtPtr;
-typedef std::vector<std::unique_ptr<Stmt>> StmtPtrList;
+typedef Stmt* StmtPtr;
+typedef ArenaList<StmtPtr> StmtPtrList;
 
 struct StmtBlock : public Stmt
 {
-    StmtBlock(StmtPtrList&& stmts)
-        : stmts(std::move(stmts))
+    StmtBlock(const StmtPtrList& stmts)
+        : stmts(stmts)
+        , envSlots(0)
+        , frameSize(0)
     {
         type = StmtType::Block;   
     }
 
     StmtPtrList stmts;
+    int envSlots;// captured locals of the block, no environment is created if 0
+    int frameSize;// stack slots the enclosing frame needs, set by the resolver
 };
 
 struct StmtExpression : public Stmt
 {
-    StmtExpression(ExprPtr&& expr)
-        : expr(std::move(expr))
+    StmtExpression(ExprPtr expr)
+        : expr(expr)
     {
         type = StmtType::Expression;
     }
@@ -189,25 +312,32 @@ struct StmtExpression : public Stmt
 
 struct StmtFunction : public Stmt
 {
-    StmtFunction(const Token* name, const std::vector<const Token*>&& params, StmtPtrList&& body)
+    StmtFunction(const Token* name, const ArenaList<const Token*>& params, const StmtPtrList& body)
         : name(name)
         , params(params)
-        , body(std::move(body))
+        , body(body)
+        , depth(GlobalVariable)
+        , idx(0)
+        , envSlots(0)
+        , frameSize(0)
     {
         type = StmtType::Function;   
     }
 
     const Token* name;
-    std::vector<const Token*> params;
+    ArenaList<const Token*> params;
     StmtPtrList body;
+    int depth, idx;// where the function is stored in the enclosing scope
+    int envSlots;// parameters and captured locals declared directly in the body
+    int frameSize;// stack slots of a call, parameters included
 };
 
 struct StmtIf : public Stmt
 {
-    StmtIf(ExprPtr&& condition, StmtPtr&& thenBranch, StmtPtr&& elseBranch)
-        : condition(std::move(condition))
-        , thenBranch(std::move(thenBranch))
-        , elseBranch(std::move(elseBranch))
+    StmtIf(ExprPtr condition, StmtPtr thenBranch, StmtPtr elseBranch)
+        : condition(condition)
+        , thenBranch(thenBranch)
+        , elseBranch(elseBranch)
     {
         type = StmtType::If;
     }
@@ -218,8 +348,8 @@ struct StmtIf : public Stmt
 
 struct StmtPrint : public Stmt
 {
-    StmtPrint(ExprPtr&& expr)
-        : expr(std::move(expr))
+    StmtPrint(ExprPtr expr)
+        : expr(expr)
     {
         type = StmtType::Print;
     }
@@ -229,35 +359,40 @@ struct StmtPrint : public Stmt
 
 struct StmtReturn : public Stmt
 {
-    StmtReturn(const Token* keyword, ExprPtr&& value)
+    StmtReturn(const Token* keyword, ExprPtr value)
         : keyword(keyword)
-        , value(std::move(value))
+        , value(value)
+        , tailCall(false)
     {
         type = StmtType::Return;
     }
 
     const Token* keyword;
     ExprPtr value;
+    bool tailCall;// value is a call the callee can run in this frame, set by the resolver
 };
 
 struct StmtVar : public Stmt
 {
-    StmtVar(const Token* name, ExprPtr&& init)
+    StmtVar(const Token* name, ExprPtr init)
         : name(name)
-        , init(std::move(init))
+        , init(init)
+        , depth(GlobalVariable)
+        , idx(0)
     {
         type = StmtType::Var;
     }
 
     const Token* name;
     ExprPtr init;
+    int depth, idx;
 };
 
 struct StmtWhile : public Stmt
 {
-    StmtWhile(ExprPtr&& condition, StmtPtr&& body)
-        : condition(std::move(condition))
-        , body(std::move(body))
+    StmtWhile(ExprPtr condition, StmtPtr body)
+        : condition(condition)
+        , body(body)
     {
         type = StmtType::While;
     }
@@ -266,18 +401,21 @@ struct StmtWhile : public Stmt
     StmtPtr body;
 };
 
-typedef std::unique_ptr<StmtFunction> StmtFunctionPtr;
-typedef std::vector<std::unique_ptr<StmtFunction>> StmtFunctionPtrList;
+typedef StmtFunction* StmtFunctionPtr;
+typedef ArenaList<StmtFunctionPtr> StmtFunctionPtrList;
 
 struct StmtClass : public Stmt
 {
-    StmtClass(const Token* name, StmtFunctionPtrList&& methods)
+    StmtClass(const Token* name, const StmtFunctionPtrList& methods)
         : name(name)
-        , methods(std::move(methods))
+        , methods(methods)
+        , depth(GlobalVariable)
+        , idx(0)
     {
         type = StmtType::Class;   
     }
 
     const Token* name;
     StmtFunctionPtrList methods;
+    int depth, idx;
 };
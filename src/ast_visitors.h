@@ -9,9 +9,11 @@ template <typename Ret> struct ExprVisitor
     virtual Ret VisitAssign(ExprAssign& expr) = 0;
     virtual Ret VisitBinary(ExprBinary& expr) = 0;
     virtual Ret VisitCall(ExprCall& expr) = 0;
+    virtual Ret VisitGet(ExprGet& expr) = 0;
     virtual Ret VisitGrouping(ExprGrouping& expr) = 0;
     virtual Ret VisitLiteral(ExprLiteral& expr) = 0;
     virtual Ret VisitLogical(ExprLogical& expr) = 0;
+    virtual Ret VisitSet(ExprSet& expr) = 0;
     virtual Ret VisitUnary(ExprUnary& expr) = 0;
     virtual Ret VisitVariable(ExprVariable& expr) = 0;
 
@@ -22,9 +24,11 @@ template <typename Ret> struct ExprVisitor
             case ExprType::Assign: return VisitAssign(static_cast<ExprAssign&>(expr));
             case ExprType::Binary: return VisitBinary(static_cast<ExprBinary&>(expr));
             case ExprType::Call: return VisitCall(static_cast<ExprCall&>(expr));
+            case ExprType::Get: return VisitGet(static_cast<ExprGet&>(expr));
             case ExprType::Grouping: return VisitGrouping(static_cast<ExprGrouping&>(expr));
             case ExprType::Literal: return VisitLiteral(static_cast<ExprLiteral&>(expr));
             case ExprType::Logical: return VisitLogical(static_cast<ExprLogical&>(expr));
+            case ExprType::Set: return VisitSet(static_cast<ExprSet&>(expr));
             case ExprType::Unary: return VisitUnary(static_cast<ExprUnary&>(expr));
             case ExprType::Variable: return VisitVariable(static_cast<ExprVariable&>(expr));
             default: return Ret();
@@ -39,9 +43,11 @@ template <typename Ret> struct ConstExprVisitor
     virtual Ret VisitAssign(const ExprAssign& expr) = 0;
     virtual Ret VisitBinary(const ExprBinary& expr) = 0;
     virtual Ret VisitCall(const ExprCall& expr) = 0;
+    virtual Ret VisitGet(const ExprGet& expr) = 0;
     virtual Ret VisitGrouping(const ExprGrouping& expr) = 0;
     virtual Ret VisitLiteral(const ExprLiteral& expr) = 0;
     virtual Ret VisitLogical(const ExprLogical& expr) = 0;
+    virtual Ret VisitSet(const ExprSet& expr) = 0;
     virtual Ret VisitUnary(const ExprUnary& expr) = 0;
     virtual Ret VisitVariable(const ExprVariable& expr) = 0;
 
@@ -52,9 +58,11 @@ template <typename Ret> struct ConstExprVisitor
             case ExprType::Assign: return VisitAssign(static_cast<const ExprAssign&>(expr));
             case ExprType::Binary: return VisitBinary(static_cast<const ExprBinary&>(expr));
             case ExprType::Call: return VisitCall(static_cast<const ExprCall&>(expr));
+            case ExprType::Get: return VisitGet(static_cast<const ExprGet&>(expr));
             case ExprType::Grouping: return VisitGrouping(static_cast<const ExprGrouping&>(expr));
             case ExprType::Literal: return VisitLiteral(static_cast<const ExprLiteral&>(expr));
             case ExprType::Logical: return VisitLogical(static_cast<const ExprLogical&>(expr));
+            case ExprType::Set: return VisitSet(static_cast<const ExprSet&>(expr));
             case ExprType::Unary: return VisitUnary(static_cast<const ExprUnary&>(expr));
             case ExprType::Variable: return VisitVariable(static_cast<const ExprVariable&>(expr));
             default: return Ret();
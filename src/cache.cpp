@@ -0,0 +1,317 @@
+#include "cache.h"
+#include "scanner.h"
+#include "source.h"
+#include "symbols.h"
+#include "flat_ast.h"
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+// Bump whenever the token, flat AST or resolver output changes meaning
+static const uint32_t CacheVersion = 9;
+static const char CacheMagic[4] = { 'L', 'O', 'X', 'C' };
+
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t tokenSize, nodeSize;// guards against layout changes between builds
+    uint64_t sourceHash;
+    uint32_t sourceLen;
+    uint32_t tokenCount, nodeCount, listCount, stringCount, symbolCount, symbolBytes;
+    uint32_t program;
+    uint64_t payloadHash;
+};
+
+struct CachedString
+{
+    uint32_t offset, length;
+};
+
+// 64-bit FNV-1a over 8 byte words, mixing in any trailing bytes at the end
+static uint64_t Hash(const void* data, size_t length, uint64_t hash = 14695981039346656037ull)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    const uint64_t prime = 1099511628211ull;
+    for (; length >= 8; bytes += 8, length -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; length > 0; ++bytes, --length)
+        hash = (hash ^ *bytes) * prime;
+    return hash;
+}
+
+std::string cache_path(const char* cacheDir, const char* source, int sourceLen)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx-%u.loxc", (unsigned long long)Hash(source, sourceLen), CacheVersion);
+    return std::string(cacheDir) + name;
+}
+
+struct CacheWriter
+{
+    std::vector<char> payload;
+
+    template <typename T> void Write(const T* items, size_t count)
+    {
+        const char* bytes = reinterpret_cast<const char*>(items);
+        payload.insert(payload.end(), bytes, bytes + sizeof(T) * count);
+    }
+};
+
+bool cache_store(const std::string& path, const char* source, int sourceLen, const std::vector<Token>& tokens, const FlatAst& ast)
+{
+    CacheHeader header;
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.tokenSize = sizeof(Token);
+    header.nodeSize = sizeof(FlatNode);
+    header.sourceHash = Hash(source, sourceLen);
+    header.sourceLen = (uint32_t)sourceLen;
+    header.tokenCount = (uint32_t)tokens.size();
+    header.nodeCount = (uint32_t)ast.nodes.size();
+    header.listCount = (uint32_t)ast.lists.size();
+    header.stringCount = (uint32_t)ast.strings.size();
+    header.program = ast.program;
+
+    // tokens are stored relative to the start of the source, and identifiers
+    // refer to a list of names local to this entry rather than to symbol ids
+    int base = tokens.empty() ? 0 : tokens.back().start - sourceLen;
+    std::unordered_map<int, uint32_t> localSymbols;
+    std::vector<int> symbols;
+    std::vector<Token> cachedTokens(tokens);
+    for (Token& token : cachedTokens)
+    {
+        token.start -= base;
+        if (token.type == TokenType::IDENTIFIER)
+        {
+            auto item = localSymbols.emplace(token.index, (uint32_t)symbols.size());
+            if (item.second)
+                symbols.push_back(token.index);
+            token.index = (int)item.first->second;
+        }
+    }
+
+    // string literal offsets are restored from the strings on load
+    std::vector<CachedString> strings;
+    for (size_t i = 0; i < ast.strings.size(); ++i)
+        strings.push_back(CachedString{ (uint32_t)(ast.strings[i] - source), 0 });
+    std::vector<FlatNode> cachedNodes(ast.nodes);
+    for (FlatNode& node : cachedNodes)
+    {
+        if (node.kind == FlatKind::Literal && (LitType)node.a == LitType::String)
+        {
+            strings[node.c].length = node.b;
+            node.d = 0;
+        }
+    }
+
+    CacheWriter writer;
+    writer.Write(cachedTokens.data(), cachedTokens.size());
+    writer.Write(cachedNodes.data(), cachedNodes.size());
+    writer.Write(ast.lists.data(), ast.lists.size());
+    writer.Write(strings.data(), strings.size());
+    std::vector<uint32_t> symbolLengths;
+    for (int symbol : symbols)
+        symbolLengths.push_back((uint32_t)symbol_name(symbol).size());
+    writer.Write(symbolLengths.data(), symbolLengths.size());
+    size_t symbolStart = writer.payload.size();
+    for (int symbol : symbols)
+        writer.Write(symbol_name(symbol).data(), symbol_name(symbol).size());
+    header.symbolCount = (uint32_t)symbols.size();
+    header.symbolBytes = (uint32_t)(writer.payload.size() - symbolStart);
+    header.payloadHash = Hash(writer.payload.data(), writer.payload.size());
+
+    // write to a temporary file and rename it into place so concurrent runs
+    // never see a partially written entry
+    std::string tempPath = path + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file)
+        return false;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(writer.payload.data(), 1, writer.payload.size(), file) == writer.payload.size();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+struct CacheReader
+{
+    const char* data;
+    size_t size, offset;
+
+    template <typename T> bool Read(std::vector<T>& items, size_t count)
+    {
+        if (count > (size - offset) / sizeof(T))
+            return false;
+        items.resize(count);
+        if (count > 0)// an empty vector's data() may be null, which memcpy rejects
+            memcpy(items.data(), data + offset, sizeof(T) * count);
+        offset += sizeof(T) * count;
+        return true;
+    }
+};
+
+// Children are always lowered before their parent, so requiring every child
+// index to be below the parent's also rules out cycles in a damaged entry.
+struct CacheValidator
+{
+    const FlatAst& ast;
+    uint32_t tokenCount;
+    NodeIdx parent;
+
+    bool Node(uint32_t idx, bool optional = false) const { return idx < parent || (optional && idx == NoNode); }
+    bool Token(uint32_t idx) const { return idx < tokenCount; }
+    bool Cache(uint32_t idx) const { return idx < ast.propertyCaches.size(); }
+    bool List(uint32_t list, bool ofTokens = false) const
+    {
+        if (list >= ast.lists.size() || ast.lists[list] > ast.lists.size() - list - 1)
+            return false;
+        for (const uint32_t* it = ast.ListBegin(list); it != ast.ListEnd(list); ++it)
+            if (ofTokens ? !Token(*it) : !Node(*it, true))
+                return false;
+        return true;
+    }
+    bool Methods(uint32_t list) const
+    {
+        if (!List(list))
+            return false;
+        for (const uint32_t* it = ast.ListBegin(list); it != ast.ListEnd(list); ++it)
+            if (*it == NoNode || ast[*it].kind != FlatKind::Function)
+                return false;
+        return true;
+    }
+
+    bool Check(const FlatNode& node) const
+    {
+        switch (node.kind)
+        {
+            case FlatKind::Assign: return Token(node.token) && Node(node.a);
+            case FlatKind::Binary:
+            case FlatKind::Logical: return Token(node.token) && Node(node.a) && Node(node.b);
+            case FlatKind::Call: return Token(node.token) && Node(node.a) && List(node.b) && node.c <= 1;
+            case FlatKind::Get: return Token(node.token) && Node(node.a) && Cache(node.b);
+            case FlatKind::Set: return Token(node.token) && Node(node.a) && Node(node.b) && Cache(node.c);
+            case FlatKind::Grouping:
+            case FlatKind::Expression:
+            case FlatKind::Print: return Node(node.a);
+            case FlatKind::Literal:
+                if (node.a > (uint32_t)LitType::Nil)
+                    return false;
+                return (LitType)node.a != LitType::String || node.c < ast.strings.size();
+            case FlatKind::Unary: return Token(node.token) && Node(node.a);
+            case FlatKind::Variable: return Token(node.token);
+            case FlatKind::Block: return List(node.a);
+            case FlatKind::Function: return Token(node.token) && List(node.a, true) && Node(node.b) && ast[node.b].kind == FlatKind::Block;
+            case FlatKind::If: return Node(node.a) && Node(node.b) && Node(node.c, true);
+            case FlatKind::Return:
+            case FlatKind::Var: return Token(node.token) && Node(node.a, true);
+            case FlatKind::While: return Node(node.a) && Node(node.b);
+            case FlatKind::Class: return Token(node.token) && Methods(node.a);
+            default: return false;
+        }
+    }
+};
+
+bool cache_load(const std::string& path, const char* source, int sourceLen, std::vector<Token>& tokens, FlatAst& ast)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    std::vector<char> contents;
+    char buf[1 << 16];
+    size_t bytesRead;
+    while ((bytesRead = fread(buf, 1, sizeof(buf), file)) > 0)
+        contents.insert(contents.end(), buf, buf + bytesRead);
+    fclose(file);
+
+    CacheHeader header;
+    if (contents.size() < sizeof(header))
+        return false;
+    memcpy(&header, contents.data(), sizeof(header));
+    if (memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 || header.version != CacheVersion
+        || header.tokenSize != sizeof(Token) || header.nodeSize != sizeof(FlatNode)
+        || header.sourceLen != (uint32_t)sourceLen || header.sourceHash != Hash(source, sourceLen))
+        return false;
+
+    CacheReader reader{ contents.data() + sizeof(header), contents.size() - sizeof(header), 0 };
+    if (header.payloadHash != Hash(reader.data, reader.size))
+        return false;
+
+    std::vector<Token> cachedTokens;
+    std::vector<CachedString> strings;
+    std::vector<uint32_t> symbolLengths;
+    std::vector<char> symbolBytes;
+    FlatAst loaded;
+    if (!reader.Read(cachedTokens, header.tokenCount) || !reader.Read(loaded.nodes, header.nodeCount)
+        || !reader.Read(loaded.lists, header.listCount) || !reader.Read(strings, header.stringCount)
+        || !reader.Read(symbolLengths, header.symbolCount) || !reader.Read(symbolBytes, header.symbolBytes)
+        || reader.offset != reader.size || cachedTokens.empty())
+        return false;
+
+    std::vector<int> symbolIds;
+    size_t symbolOffset = 0;
+    for (uint32_t length : symbolLengths)
+    {
+        if (length > symbolBytes.size() - symbolOffset)
+            return false;
+        symbolIds.push_back(symbol_intern(symbolBytes.data() + symbolOffset, (int)length));
+        symbolOffset += length;
+    }
+
+    for (const Token& token : cachedTokens)
+    {
+        if ((uint32_t)token.type > (uint32_t)TokenType::END || token.start < 0 || token.length < 0
+            || token.start > sourceLen - token.length
+            || (token.type == TokenType::IDENTIFIER && (uint32_t)token.index >= symbolIds.size()))
+            return false;
+    }
+    for (const CachedString& string : strings)
+    {
+        if (string.offset > (uint32_t)sourceLen || string.length > (uint32_t)sourceLen - string.offset)
+            return false;
+        loaded.strings.push_back(source + string.offset);
+    }
+    loaded.program = header.program;
+    // property caches are runtime state, each Get and Set starts with an empty one
+    size_t propertyCaches = 0;
+    for (const FlatNode& node : loaded.nodes)
+        if (node.kind == FlatKind::Get || node.kind == FlatKind::Set)
+            ++propertyCaches;
+    loaded.propertyCaches.resize(propertyCaches);
+    CacheValidator validator{ loaded, header.tokenCount, (NodeIdx)loaded.nodes.size() };
+    if (!validator.List(loaded.program))
+        return false;
+    for (validator.parent = 0; validator.parent < loaded.nodes.size(); ++validator.parent)
+        if (!validator.Check(loaded.nodes[validator.parent]))
+            return false;
+
+    // the entry is good, register the source and bind the tokens to it
+    int base = source_add(source, sourceLen);
+    for (Token& token : cachedTokens)
+    {
+        token.start += base;
+        if (token.type == TokenType::IDENTIFIER)
+            token.index = symbolIds[token.index];
+    }
+    // global slots are numbered per process
+    for (FlatNode& node : loaded.nodes)
+    {
+        if ((node.kind == FlatKind::Variable || node.kind == FlatKind::Assign) && (int)node.b == GlobalVariable)
+            node.c = symbol_global_slot(cachedTokens[node.token].index);
+        else if (node.kind == FlatKind::Literal && (LitType)node.a == LitType::String)
+            node.d = (uint32_t)(base + (loaded.strings[node.c] - source));
+    }
+    tokens.swap(cachedTokens);
+    loaded.tokens = tokens.data();
+    ast = std::move(loaded);
+    return true;
+}
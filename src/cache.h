@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include <vector>
+
+struct Token;
+struct FlatAst;
+
+// On-disk cache of resolved programs. Entries hold the tokens, interned names
+// and resolved flat AST of a script, and are keyed by a hash of its contents
+// and the cache format version, so a later run can skip the scanner, parser
+// and resolver entirely. Trees are stored before optimizing, so one entry
+// serves runs with and without the optimizer. Stale or corrupt entries are
+// rejected by cache_load.
+
+std::string cache_path(const char* cacheDir, const char* source, int sourceLen);
+bool cache_load(const std::string& path, const char* source, int sourceLen, std::vector<Token>& tokens, FlatAst& ast);
+bool cache_store(const std::string& path, const char* source, int sourceLen, const std::vector<Token>& tokens, const FlatAst& ast);
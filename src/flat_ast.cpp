@@ -0,0 +1,265 @@
+#include "flat_ast.h"
+#include "ast_visitors.h"
+
+struct FlatBuilder : public ExprVisitor<NodeIdx>, StmtVisitor<NodeIdx>
+{
+    FlatBuilder(const std::vector<Token>& tokens, FlatAst& ast)
+        : m_tokens(tokens)
+        , m_ast(ast)
+    {}
+
+    uint32_t TokenIdx(const Token* token) { return (uint32_t)(token - m_tokens.data()); }
+
+    NodeIdx Add(FlatKind kind, const Token* token, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0, uint32_t d = 0)
+    {
+        m_ast.nodes.push_back(FlatNode{ kind, token ? TokenIdx(token) : 0, a, b, c, d });
+        return (NodeIdx)(m_ast.nodes.size() - 1);
+    }
+
+    // children are lowered before the list is written so lists stay contiguous
+    template <typename T> uint32_t AddList(const ArenaList<T>& items)
+    {
+        std::vector<uint32_t> lowered;
+        lowered.reserve(items.size());
+        for (T item : items)
+            lowered.push_back(Lower(item));
+        uint32_t list = (uint32_t)m_ast.lists.size();
+        m_ast.lists.push_back((uint32_t)lowered.size());
+        m_ast.lists.insert(m_ast.lists.end(), lowered.begin(), lowered.end());
+        return list;
+    }
+
+    NodeIdx Lower(Expr* expr) { return expr ? VisitExpr(*expr) : NoNode; }
+    NodeIdx Lower(Stmt* stmt) { return stmt ? VisitStmt(*stmt) : NoNode; }
+    NodeIdx Lower(StmtFunction* stmt) { return stmt ? VisitFunction(*stmt) : NoNode; }
+    NodeIdx Lower(const Token* token) { return TokenIdx(token); }
+
+    uint32_t AddPropertyCache()
+    {
+        m_ast.propertyCaches.push_back(PropertyCache());
+        return (uint32_t)(m_ast.propertyCaches.size() - 1);
+    }
+
+    NodeIdx VisitAssign(ExprAssign& expr) override { return Add(FlatKind::Assign, expr.name, Lower(expr.value), expr.depth, expr.idx); }
+    NodeIdx VisitBinary(ExprBinary& expr) override
+    {
+        NodeIdx left = Lower(expr.left);
+        return Add(FlatKind::Binary, expr.op, left, Lower(expr.right));
+    }
+    NodeIdx VisitCall(ExprCall& expr) override
+    {
+        NodeIdx callee = Lower(expr.callee);
+        return Add(FlatKind::Call, expr.paren, callee, AddList(expr.args), (uint32_t)expr.arityChecked);
+    }
+    NodeIdx VisitGet(ExprGet& expr) override { return Add(FlatKind::Get, expr.name, Lower(expr.object), AddPropertyCache()); }
+    NodeIdx VisitGrouping(ExprGrouping& expr) override { return Add(FlatKind::Grouping, nullptr, Lower(expr.expr)); }
+    NodeIdx VisitLiteral(ExprLiteral& expr) override
+    {
+        uint32_t text = 0;
+        if (expr.litType == LitType::String)
+        {
+            text = (uint32_t)m_ast.strings.size();
+            m_ast.strings.push_back(expr.stringValue);
+        }
+        return Add(FlatKind::Literal, nullptr, (uint32_t)expr.litType, (uint32_t)expr.intValue, text, (uint32_t)expr.offset);
+    }
+    NodeIdx VisitLogical(ExprLogical& expr) override
+    {
+        NodeIdx left = Lower(expr.left);
+        return Add(FlatKind::Logical, expr.op, left, Lower(expr.right));
+    }
+    NodeIdx VisitSet(ExprSet& expr) override
+    {
+        NodeIdx object = Lower(expr.object);
+        return Add(FlatKind::Set, expr.name, object, Lower(expr.value), AddPropertyCache());
+    }
+    NodeIdx VisitUnary(ExprUnary& expr) override { return Add(FlatKind::Unary, expr.op, Lower(expr.right)); }
+    NodeIdx VisitVariable(ExprVariable& expr) override { return Add(FlatKind::Variable, expr.name, 0, expr.depth, expr.idx); }
+
+    NodeIdx VisitBlock(StmtBlock& stmt) override { return Add(FlatKind::Block, nullptr, AddList(stmt.stmts), stmt.envSlots, stmt.frameSize); }
+    NodeIdx VisitExpression(StmtExpression& stmt) override { return Add(FlatKind::Expression, nullptr, Lower(stmt.expr)); }
+    NodeIdx VisitFunction(StmtFunction& stmt) override
+    {
+        uint32_t params = AddList(stmt.params);
+        NodeIdx body = Add(FlatKind::Block, nullptr, AddList(stmt.body), stmt.envSlots, stmt.frameSize);
+        return Add(FlatKind::Function, stmt.name, params, body, stmt.depth, stmt.idx);
+    }
+    NodeIdx VisitIf(StmtIf& stmt) override
+    {
+        NodeIdx condition = Lower(stmt.condition);
+        NodeIdx thenBranch = Lower(stmt.thenBranch);
+        return Add(FlatKind::If, nullptr, condition, thenBranch, Lower(stmt.elseBranch));
+    }
+    NodeIdx VisitPrint(StmtPrint& stmt) override { return Add(FlatKind::Print, nullptr, Lower(stmt.expr)); }
+    NodeIdx VisitReturn(StmtReturn& stmt) override { return Add(FlatKind::Return, stmt.keyword, Lower(stmt.value), stmt.tailCall ? 1 : 0); }
+    NodeIdx VisitVar(StmtVar& stmt) override { return Add(FlatKind::Var, stmt.name, Lower(stmt.init), stmt.depth, stmt.idx); }
+    NodeIdx VisitWhile(StmtWhile& stmt) override
+    {
+        NodeIdx condition = Lower(stmt.condition);
+        return Add(FlatKind::While, nullptr, condition, Lower(stmt.body));
+    }
+    NodeIdx VisitClass(StmtClass& stmt) override { return Add(FlatKind::Class, stmt.name, AddList(stmt.methods), stmt.depth, stmt.idx); }
+
+    const std::vector<Token>& m_tokens;
+    FlatAst& m_ast;
+};
+
+void flatast_build(const std::vector<Token>& tokens, const StmtPtrList& stmts, FlatAst& ast)
+{
+    ast.tokens = tokens.data();
+    FlatBuilder builder(tokens, ast);
+    ast.program = builder.AddList(stmts);
+}
+
+NodeIdx flatast_lower(const std::vector<Token>& tokens, Stmt& stmt, FlatAst& ast)
+{
+    ast.tokens = tokens.data();
+    FlatBuilder builder(tokens, ast);
+    return builder.VisitStmt(stmt);
+}
+
+void flatast_finish(FlatAst& ast, const std::vector<NodeIdx>& program)
+{
+    ast.program = (uint32_t)ast.lists.size();
+    ast.lists.push_back((uint32_t)program.size());
+    ast.lists.insert(ast.lists.end(), program.begin(), program.end());
+    ast.nodes.shrink_to_fit();
+    ast.lists.shrink_to_fit();
+}
+
+// Rebuilds the pointer tree from flat form, keeping the resolver's annotations
+struct TreeRaiser
+{
+    const FlatAst& m_ast;
+    Arena& m_arena;
+
+    const Token* GetToken(uint32_t idx) { return &m_ast.tokens[idx]; }
+
+    template <typename T> ArenaList<T> RaiseList(uint32_t list)
+    {
+        std::vector<T> items;
+        items.reserve(m_ast.ListSize(list));
+        for (const uint32_t* it = m_ast.ListBegin(list); it != m_ast.ListEnd(list); ++it)
+            items.push_back(static_cast<T>(RaiseStmt(*it)));
+        return m_arena.NewList(items);
+    }
+
+    ArenaList<const Token*> RaiseTokens(uint32_t list)
+    {
+        std::vector<const Token*> items;
+        for (const uint32_t* it = m_ast.ListBegin(list); it != m_ast.ListEnd(list); ++it)
+            items.push_back(GetToken(*it));
+        return m_arena.NewList(items);
+    }
+
+    ExprPtrList RaiseExprs(uint32_t list)
+    {
+        std::vector<ExprPtr> items;
+        for (const uint32_t* it = m_ast.ListBegin(list); it != m_ast.ListEnd(list); ++it)
+            items.push_back(RaiseExpr(*it));
+        return m_arena.NewList(items);
+    }
+
+    ExprPtr RaiseExpr(NodeIdx idx)
+    {
+        if (idx == NoNode)
+            return nullptr;
+        const FlatNode& node = m_ast[idx];
+        switch (node.kind)
+        {
+            case FlatKind::Assign:
+            {
+                ExprAssign* expr = m_arena.New<ExprAssign>(GetToken(node.token), RaiseExpr(node.a));
+                expr->depth = (int)node.b;
+                expr->idx = (int)node.c;
+                return expr;
+            }
+            case FlatKind::Binary: return m_arena.New<ExprBinary>(RaiseExpr(node.a), GetToken(node.token), RaiseExpr(node.b));
+            case FlatKind::Call:
+            {
+                ExprCall* expr = m_arena.New<ExprCall>(RaiseExpr(node.a), GetToken(node.token), RaiseExprs(node.b));
+                expr->arityChecked = (int)node.c;
+                return expr;
+            }
+            case FlatKind::Get: return m_arena.New<ExprGet>(RaiseExpr(node.a), GetToken(node.token));
+            case FlatKind::Grouping: return m_arena.New<ExprGrouping>(RaiseExpr(node.a));
+            case FlatKind::Literal:
+                switch ((LitType)node.a)
+                {
+                    case LitType::Int: return m_arena.New<ExprLiteral>((int)node.b);
+                    case LitType::Bool: return m_arena.New<ExprLiteral>(node.b != 0);
+                    case LitType::String: return m_arena.New<ExprLiteral>(m_ast.strings[node.c], (int)node.b, (int)node.d);
+                    default: return m_arena.New<ExprLiteral>();
+                }
+            case FlatKind::Logical: return m_arena.New<ExprLogical>(RaiseExpr(node.a), GetToken(node.token), RaiseExpr(node.b));
+            case FlatKind::Set: return m_arena.New<ExprSet>(RaiseExpr(node.a), GetToken(node.token), RaiseExpr(node.b));
+            case FlatKind::Unary: return m_arena.New<ExprUnary>(GetToken(node.token), RaiseExpr(node.a));
+            case FlatKind::Variable:
+            {
+                ExprVariable* expr = m_arena.New<ExprVariable>(GetToken(node.token));
+                expr->depth = (int)node.b;
+                expr->idx = (int)node.c;
+                return expr;
+            }
+            default: return nullptr;
+        }
+    }
+
+    StmtPtr RaiseStmt(NodeIdx idx)
+    {
+        if (idx == NoNode)
+            return nullptr;
+        const FlatNode& node = m_ast[idx];
+        switch (node.kind)
+        {
+            case FlatKind::Block:
+            {
+                StmtBlock* stmt = m_arena.New<StmtBlock>(RaiseList<StmtPtr>(node.a));
+                stmt->envSlots = (int)node.b;
+                stmt->frameSize = (int)node.c;
+                return stmt;
+            }
+            case FlatKind::Expression: return m_arena.New<StmtExpression>(RaiseExpr(node.a));
+            case FlatKind::Function:
+            {
+                const FlatNode& body = m_ast[node.b];
+                StmtFunction* stmt = m_arena.New<StmtFunction>(GetToken(node.token), RaiseTokens(node.a), RaiseList<StmtPtr>(body.a));
+                stmt->depth = (int)node.c;
+                stmt->idx = (int)node.d;
+                stmt->envSlots = (int)body.b;
+                stmt->frameSize = (int)body.c;
+                return stmt;
+            }
+            case FlatKind::If: return m_arena.New<StmtIf>(RaiseExpr(node.a), RaiseStmt(node.b), RaiseStmt(node.c));
+            case FlatKind::Print: return m_arena.New<StmtPrint>(RaiseExpr(node.a));
+            case FlatKind::Return:
+            {
+                StmtReturn* stmt = m_arena.New<StmtReturn>(GetToken(node.token), RaiseExpr(node.a));
+                stmt->tailCall = node.b != 0;
+                return stmt;
+            }
+            case FlatKind::Var:
+            {
+                StmtVar* stmt = m_arena.New<StmtVar>(GetToken(node.token), RaiseExpr(node.a));
+                stmt->depth = (int)node.b;
+                stmt->idx = (int)node.c;
+                return stmt;
+            }
+            case FlatKind::While: return m_arena.New<StmtWhile>(RaiseExpr(node.a), RaiseStmt(node.b));
+            case FlatKind::Class:
+            {
+                StmtClass* stmt = m_arena.New<StmtClass>(GetToken(node.token), RaiseList<StmtFunctionPtr>(node.a));
+                stmt->depth = (int)node.b;
+                stmt->idx = (int)node.c;
+                return stmt;
+            }
+            default: return nullptr;
+        }
+    }
+};
+
+void flatast_raise(const FlatAst& ast, Arena& arena, StmtPtrList& stmts)
+{
+    TreeRaiser raiser{ ast, arena };
+    stmts = raiser.RaiseList<StmtPtr>(ast.program);
+}
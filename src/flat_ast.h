@@ -0,0 +1,79 @@
+#pragma once
+#include "ast.h"
+#include <cstdint>
+#include <vector>
+
+// Alternative flat representation of a program. Nodes live in one contiguous
+// array and refer to each other, to tokens and to child lists by 32-bit index
+// instead of by pointer. Lists (block statements, call arguments, parameters,
+// methods) are stored in a side array as a count followed by the items.
+
+typedef uint32_t NodeIdx;
+const NodeIdx NoNode = 0xFFFFFFFF;
+
+enum class FlatKind : uint8_t
+{
+    // expressions
+    Assign, Binary, Call, Get, Grouping, Literal, Logical, Set, Unary, Variable,
+    // statements
+    Block, Expression, Function, If, Print, Return, Var, While, Class
+};
+
+// Meaning of the operands for each kind:
+//   Assign     token = name,    a = value,     b = depth, c = idx
+//   Binary     token = op,      a = left,      b = right
+//   Call       token = paren,   a = callee,    b = argument list, c = arity checked
+//   Get        token = name,    a = object,    b = property cache
+//   Grouping                    a = expr
+//   Literal                     a = LitType,   b = value or length, c = string, d = string offset
+//   Logical    token = op,      a = left,      b = right
+//   Set        token = name,    a = object,    b = value,     c = property cache
+//   Unary      token = op,      a = right
+//   Variable   token = name,                   b = depth, c = idx
+//   Block                       a = statement list, b = environment slots, c = frame size
+//   Expression                  a = expr
+//   Function   token = name,    a = parameter token list, b = body Block, c = depth, d = idx
+//   If                          a = condition, b = then,  c = else or NoNode
+//   Print                       a = expr
+//   Return     token = keyword, a = value or NoNode, b = 1 for a tail call
+//   Var        token = name,    a = init or NoNode, b = depth, c = idx
+//   While                       a = condition, b = body
+//   Class      token = name,    a = method list, b = depth, c = idx
+// A Function's body Block shares the scope of the parameters, so its
+// environment slots and frame size cover them too.
+struct FlatNode
+{
+    FlatKind kind;
+    uint32_t token;
+    uint32_t a, b, c, d;
+};
+
+struct FlatAst
+{
+    const Token* tokens;
+    std::vector<FlatNode> nodes;
+    std::vector<uint32_t> lists;
+    std::vector<const char*> strings;// string literal text, still pointing into the source
+    mutable std::vector<PropertyCache> propertyCaches;// one per Get and Set, filled in as the program runs
+    uint32_t program;// list of top level statements
+
+    const FlatNode& operator[](NodeIdx idx) const { return nodes[idx]; }
+    FlatNode& operator[](NodeIdx idx) { return nodes[idx]; }
+    const Token* GetToken(const FlatNode& node) const { return &tokens[node.token]; }
+    uint32_t ListSize(uint32_t list) const { return lists[list]; }
+    const uint32_t* ListBegin(uint32_t list) const { return &lists[list + 1]; }
+    const uint32_t* ListEnd(uint32_t list) const { return &lists[list + 1] + lists[list]; }
+};
+
+// Lowers a parsed program into flat form. tokens must be the token array the
+// program was parsed from; the tree can be discarded once this returns.
+void flatast_build(const std::vector<Token>& tokens, const StmtPtrList& stmts, FlatAst& ast);
+
+// Lowers one top level statement at a time, so the tree for each can be
+// discarded before the next is parsed. flatast_finish records the program.
+NodeIdx flatast_lower(const std::vector<Token>& tokens, Stmt& stmt, FlatAst& ast);
+void flatast_finish(FlatAst& ast, const std::vector<NodeIdx>& program);
+
+// Rebuilds a pointer tree, resolver annotations included, from a flat program.
+// Used when a resolved program is loaded from the compilation cache.
+void flatast_raise(const FlatAst& ast, Arena& arena, StmtPtrList& stmts);
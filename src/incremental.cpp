@@ -0,0 +1,300 @@
+#include "incremental.h"
+#include "lox.h"
+#include "parser.h"
+#include "resolver.h"
+#include "source.h"
+#include <algorithm>
+#include <cstring>
+
+static bool IsAlpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool IsAlphaNumeric(char c)
+{
+    return IsAlpha(c) || (c >= '0' && c <= '9');
+}
+
+static int CountLines(const char* text, int length)
+{
+    return (int)std::count(text, text + length, '\n');
+}
+
+// Skips whitespace and comments, returning the start of the next token
+static int SkipTrivia(const std::string& text, int pos, int end)
+{
+    while (pos < end)
+    {
+        char c = text[pos];
+        if (c == '/' && pos + 1 < end && text[pos + 1] == '/')
+        {
+            const char* newline = (const char*)memchr(&text[pos], '\n', end - pos);
+            pos = newline ? (int)(newline - text.data()) : end;
+        }
+        else if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            ++pos;
+        else
+            break;
+    }
+    return pos;
+}
+
+static bool IsElse(const std::string& text, int pos, int end)
+{
+    return end - pos >= 4 && text.compare(pos, 4, "else") == 0 && (end - pos == 4 || !IsAlphaNumeric(text[pos + 4]));
+}
+
+// Splits [begin, end) of text into top level declarations without running the
+// scanner or parser. Every statement ends with ';' or '}', so a declaration
+// ends at such a token outside any brackets unless an else follows it. Fills
+// ends with the end of each declaration, the last one extended to end, and
+// returns false if the last declaration may continue past end.
+static bool SplitDecls(const std::string& text, int begin, int end, std::vector<int>& ends)
+{
+    int depth = 0, pending = -1, lastToken = begin;
+    bool complete = true;
+    for (int pos = SkipTrivia(text, begin, end); pos < end; pos = SkipTrivia(text, pos, end))
+    {
+        if (pending >= 0)
+        {
+            if (!IsElse(text, pos, end))
+                ends.push_back(pending);
+            pending = -1;
+        }
+
+        char c = text[pos];
+        if (c == '"')
+        {
+            const char* close = (const char*)memchr(&text[pos + 1], '"', end - pos - 1);
+            if (!close)
+            {
+                complete = false;
+                lastToken = end;
+                break;
+            }
+            pos = (int)(close - text.data()) + 1;
+        }
+        else if (IsAlpha(c))
+        {
+            while (pos < end && IsAlphaNumeric(text[pos]))
+                ++pos;
+        }
+        else
+        {
+            ++pos;
+            if (c == '(' || c == '{')
+                ++depth;
+            else if (c == ')' || c == '}')
+                depth = std::max(depth - 1, 0);
+            if ((c == ';' || c == '}') && depth == 0)
+                pending = pos;
+        }
+        lastToken = pos;
+    }
+
+    if (pending >= 0)
+    {
+        // the declaration continues if the text after the range starts with else
+        ends.push_back(pending);
+        complete = complete && !IsElse(text, SkipTrivia(text, end, (int)text.size()), (int)text.size());
+    }
+    if (lastToken > (ends.empty() ? begin : ends.back()))
+    {
+        // tokens after the last complete declaration
+        complete = false;
+        ends.push_back(end);
+    }
+    else if (ends.empty())
+        ends.push_back(end);
+    else
+        ends.back() = end;
+    return complete;
+}
+
+// text is about to be freed, so its offsets go back to be reused
+IncrementalDecl::~IncrementalDecl()
+{
+    if (!tokens.empty())
+        source_remove(tokens.back().start);
+}
+
+static IncrementalDecl* CompileDecl(const std::string& text, int begin, int end, int line)
+{
+    IncrementalDecl* decl = new IncrementalDecl();
+    decl->begin = begin;
+    decl->end = end;
+    decl->line = line;
+    decl->text.assign(text, begin, end - begin);
+
+    int errorCount = lox_error_count();
+    scanner_scan(decl->text.data(), (int)decl->text.size(), decl->tokens, 1, line);
+    parser_parse(decl->tokens, decl->arena, decl->stmts);
+    // statements with syntax errors can be missing children
+    if (lox_error_count() == errorCount)
+        resolver_resolve(decl->stmts);
+    decl->errorCount = lox_error_count() - errorCount;
+
+    for (StmtPtr stmt : decl->stmts)
+    {
+        if (!stmt)
+            continue;
+        switch (stmt->type)
+        {
+            case StmtType::Var: decl->names.push_back(static_cast<StmtVar*>(stmt)->name); break;
+            case StmtType::Function: decl->names.push_back(static_cast<StmtFunction*>(stmt)->name); break;
+            case StmtType::Class: decl->names.push_back(static_cast<StmtClass*>(stmt)->name); break;
+            default: break;
+        }
+    }
+    return decl;
+}
+
+struct GlobalsBefore
+{
+    size_t count;
+    const IncrementalDecl* first;
+};
+
+static void TouchGlobal(IncrementalDocument& doc, int symbol, std::unordered_map<int, GlobalsBefore>& touched)
+{
+    if (touched.count(symbol))
+        return;
+    const std::vector<const IncrementalDecl*>& declarers = doc.globals[symbol];
+    touched[symbol] = GlobalsBefore{ declarers.size(), declarers.empty() ? nullptr : declarers.front() };
+}
+
+static const Token* DeclaredName(const IncrementalDecl& decl, int symbol)
+{
+    for (const Token* name : decl.names)
+        if (name->index == symbol)
+            return name;
+    return nullptr;
+}
+
+// Moves the globals declared by the replaced declarations over to the ones
+// replacing them. Declarers are kept in document order, and a declaration
+// that is not the first of its global is reported when it becomes one, like
+// the resolver does for a whole program.
+static void UpdateGlobals(IncrementalDocument& doc, size_t first, size_t last, const std::vector<std::unique_ptr<IncrementalDecl>>& compiled)
+{
+    std::unordered_map<int, GlobalsBefore> touched;
+    for (size_t i = first; i < last; ++i)
+    {
+        for (const Token* name : doc.decls[i]->names)
+        {
+            TouchGlobal(doc, name->index, touched);
+            std::vector<const IncrementalDecl*>& declarers = doc.globals[name->index];
+            declarers.erase(std::find(declarers.begin(), declarers.end(), doc.decls[i].get()));
+        }
+    }
+    auto byBegin = [](const IncrementalDecl* decl, const IncrementalDecl* other) { return decl->begin < other->begin; };
+    for (const std::unique_ptr<IncrementalDecl>& decl : compiled)
+    {
+        for (const Token* name : decl->names)
+        {
+            TouchGlobal(doc, name->index, touched);
+            std::vector<const IncrementalDecl*>& declarers = doc.globals[name->index];
+            declarers.insert(std::upper_bound(declarers.begin(), declarers.end(), decl.get(), byBegin), decl.get());
+        }
+    }
+
+    for (const auto& item : touched)
+    {
+        std::vector<const IncrementalDecl*>& declarers = doc.globals[item.first];
+        doc.duplicateCount += (int)std::max(declarers.size(), (size_t)1) - (int)std::max(item.second.count, (size_t)1);
+        for (size_t i = 1; i < declarers.size(); ++i)
+        {
+            const IncrementalDecl* decl = declarers[i];
+            bool isNew = decl->begin >= compiled.front()->begin && decl->end <= compiled.back()->end;
+            if (isNew || decl == item.second.first)
+                lox_error(*DeclaredName(*decl, item.first), "Variable with this name already declared in this scope");
+        }
+        if (declarers.empty())
+            doc.globals.erase(item.first);
+    }
+}
+
+// Recompiles the document text from begin to ends.back() into declarations
+// ending at ends and puts them in place of decls [first, last)
+static void Recompile(IncrementalDocument& doc, size_t first, size_t last, int begin, int line, const std::vector<int>& ends)
+{
+    std::vector<std::unique_ptr<IncrementalDecl>> compiled;
+    for (int declEnd : ends)
+    {
+        compiled.emplace_back(CompileDecl(doc.text, begin, declEnd, line));
+        line += CountLines(&doc.text[begin], declEnd - begin);
+        begin = declEnd;
+    }
+    UpdateGlobals(doc, first, last, compiled);
+    doc.decls.erase(doc.decls.begin() + first, doc.decls.begin() + last);
+    doc.decls.insert(doc.decls.begin() + first, std::make_move_iterator(compiled.begin()), std::make_move_iterator(compiled.end()));
+}
+
+static bool HasErrors(const IncrementalDocument& doc)
+{
+    if (doc.duplicateCount > 0)
+        return true;
+    for (const std::unique_ptr<IncrementalDecl>& decl : doc.decls)
+        if (decl->errorCount > 0)
+            return true;
+    return false;
+}
+
+bool incremental_open(IncrementalDocument& doc, const char* source, int sourceLen)
+{
+    doc.text.assign(source, sourceLen);
+    doc.decls.clear();
+    doc.globals.clear();
+    doc.duplicateCount = 0;
+    std::vector<int> ends;
+    SplitDecls(doc.text, 0, sourceLen, ends);
+    Recompile(doc, 0, 0, 0, 1, ends);
+    return !HasErrors(doc);
+}
+
+bool incremental_edit(IncrementalDocument& doc, int editBegin, int editEnd, const char* text, int textLen)
+{
+    // the declarations the edit touches, including one that ends right where
+    // it begins, as the edit may extend its last token
+    auto byBegin = [](int offset, const std::unique_ptr<IncrementalDecl>& decl) { return offset < decl->begin; };
+    size_t first = std::upper_bound(doc.decls.begin(), doc.decls.end(), editBegin, byBegin) - doc.decls.begin() - 1;
+    size_t last = std::upper_bound(doc.decls.begin(), doc.decls.end(), editEnd, byBegin) - doc.decls.begin();
+    if (first > 0 && doc.decls[first]->begin == editBegin)
+        --first;
+
+    int delta = textLen - (editEnd - editBegin);
+    int lineDelta = CountLines(text, textLen) - CountLines(&doc.text[editBegin], editEnd - editBegin);
+    doc.text.replace(editBegin, editEnd - editBegin, text, textLen);
+
+    // widen until the damaged text ends on a declaration boundary
+    int begin = doc.decls[first]->begin;
+    std::vector<int> ends;
+    while (true)
+    {
+        ends.clear();
+        if (SplitDecls(doc.text, begin, doc.decls[last - 1]->end + delta, ends) || last == doc.decls.size())
+            break;
+        ++last;
+    }
+
+    for (size_t i = last; i < doc.decls.size(); ++i)
+    {
+        IncrementalDecl& decl = *doc.decls[i];
+        decl.begin += delta;
+        decl.end += delta;
+        if (lineDelta != 0)
+        {
+            decl.line += lineDelta;
+            source_set_first_line(decl.tokens.back().start, decl.line);
+        }
+    }
+    Recompile(doc, first, last, begin, doc.decls[first]->line, ends);
+    return !HasErrors(doc);
+}
+
+void incremental_stmts(const IncrementalDocument& doc, std::vector<StmtPtr>& stmts)
+{
+    for (const std::unique_ptr<IncrementalDecl>& decl : doc.decls)
+        stmts.insert(stmts.end(), decl->stmts.begin(), decl->stmts.end());
+}
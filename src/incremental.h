@@ -0,0 +1,46 @@
+#pragma once
+#include "ast.h"
+#include "scanner.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One top level declaration of an incrementally compiled document, together
+// with the whitespace and comments that follow it. Each declaration owns a
+// copy of its text, its tokens and its AST so it can be kept across edits
+// elsewhere in the document.
+struct IncrementalDecl
+{
+    ~IncrementalDecl();
+
+    int begin, end;// span in the document text
+    int line;// line the span starts on
+    std::string text;
+    std::vector<Token> tokens;
+    Arena arena;
+    StmtPtrList stmts;
+    std::vector<const Token*> names;// globals its top level statements declare
+    int errorCount;// errors reported while compiling it
+};
+
+// Front end state for a document that is edited in place, e.g. by an editor.
+// Declarations span the whole text in order. An edit rescans, reparses and
+// re-resolves only the declarations it touches (widened until they end on a
+// declaration boundary again); the others are reused with shifted positions.
+// Each declaration is resolved on its own, so globals declared more than once
+// across declarations are checked here.
+struct IncrementalDocument
+{
+    std::string text;
+    std::vector<std::unique_ptr<IncrementalDecl>> decls;
+    std::unordered_map<int, std::vector<const IncrementalDecl*>> globals;// symbol id to the declarations declaring it
+    int duplicateCount = 0;// declarations of a global after its first
+};
+
+// Both return true if the whole document is free of errors
+bool incremental_open(IncrementalDocument& doc, const char* source, int sourceLen);
+bool incremental_edit(IncrementalDocument& doc, int editBegin, int editEnd, const char* text, int textLen);
+
+// Top level statements of the whole document, in order
+void incremental_stmts(const IncrementalDocument& doc, std::vector<StmtPtr>& stmts);
@@ -0,0 +1,373 @@
+#include "bytecode.h"
+#include "ast_visitors.h"
+#include "class.h"
+#include <algorithm>
+#include <cstring>
+
+// Compiles the resolved tree into bytecode. Each expression leaves exactly one
+// value on the stack, and the compiler counts the values to size the frame's
+// temporaries.
+struct BytecodeCompiler : public ConstExprVisitor<void>, ConstStmtVisitor<void>
+{
+    BytecodeCompiler(BytecodeProgram& program)
+        : m_program(program)
+    {}
+
+    void Emit(OpCode op, int stackEffect = 0)
+    {
+        m_function->code.push_back((uint8_t)op);
+        m_depth += stackEffect;
+        m_function->maxStack = std::max(m_function->maxStack, m_depth);
+    }
+
+    void EmitU16(int value)
+    {
+        uint16_t operand = (uint16_t)value;
+        uint8_t bytes[2];
+        memcpy(bytes, &operand, 2);
+        m_function->code.insert(m_function->code.end(), bytes, bytes + 2);
+    }
+
+    void EmitU32(uint32_t operand)
+    {
+        uint8_t bytes[4];
+        memcpy(bytes, &operand, 4);
+        m_function->code.insert(m_function->code.end(), bytes, bytes + 4);
+    }
+
+    void EmitToken(const Token* token)
+    {
+        EmitU32((uint32_t)m_function->tokens.size());
+        m_function->tokens.push_back(token);
+    }
+
+    void EmitPropertyCache()
+    {
+        EmitU32((uint32_t)m_function->propertyCaches.size());
+        m_function->propertyCaches.push_back(PropertyCache());
+    }
+
+    // returns where the target goes, see PatchJump
+    uint32_t EmitJump()
+    {
+        uint32_t at = (uint32_t)m_function->code.size();
+        EmitU32(0);
+        return at;
+    }
+
+    void PatchJump(uint32_t at)
+    {
+        uint32_t target = (uint32_t)m_function->code.size();
+        memcpy(&m_function->code[at], &target, 4);
+    }
+
+    void Compile(Expr* expr)
+    {
+        if (expr)
+            VisitExpr(*expr);
+        else
+            Emit(OpCode::Nil, 1);
+    }
+
+    void Compile(Stmt* stmt)
+    {
+        // a missing statement fails like it does in the tree walker
+        if (stmt)
+            VisitStmt(*stmt);
+        else
+            Emit(OpCode::Exit);
+    }
+
+    void EmitDefine(const Token* name, int depth, int idx)
+    {
+        if (depth == StackVariable)
+        {
+            Emit(OpCode::DefineLocal, -1);
+            EmitU16(idx);
+        }
+        else if (depth == GlobalVariable)
+        {
+            Emit(OpCode::DefineGlobal, -1);
+            EmitToken(name);
+        }
+        else
+        {
+            Emit(OpCode::DefineEnv, -1);
+            EmitU16(idx);
+        }
+    }
+
+    void EmitVariable(OpCode local, OpCode env, OpCode global, int stackEffect, const Token* name, int depth, int idx)
+    {
+        if (depth == StackVariable)
+        {
+            Emit(local, stackEffect);
+            EmitU16(idx);
+        }
+        else if (depth == GlobalVariable)
+        {
+            Emit(global, stackEffect);
+            EmitToken(name);
+            EmitU32((uint32_t)idx);
+        }
+        else
+        {
+            Emit(env, stackEffect);
+            EmitU16(depth);
+            EmitU16(idx);
+        }
+    }
+
+    BytecodeFunction* BeginFunction()
+    {
+        m_program.functions.emplace_back(new BytecodeFunction());
+        BytecodeFunction* function = m_program.functions.back().get();
+        m_function = function;
+        m_depth = 0;
+        m_frameSize = 0;
+        return function;
+    }
+
+    void EndFunction()
+    {
+        Emit(OpCode::Exit);
+        m_function->frameSize = std::max(m_function->frameSize, m_frameSize);
+    }
+
+    void VisitAssign(const ExprAssign& expr) override
+    {
+        Compile(expr.value);
+        EmitVariable(OpCode::SetLocal, OpCode::SetEnv, OpCode::SetGlobal, 0, expr.name, expr.depth, expr.idx);
+    }
+
+    void VisitBinary(const ExprBinary& expr) override
+    {
+        Compile(expr.left);
+        Compile(expr.right);
+        switch (expr.op->type)
+        {
+            case TokenType::PLUS: Emit(OpCode::Add, -1); break;
+            case TokenType::MINUS: Emit(OpCode::Subtract, -1); break;
+            case TokenType::STAR: Emit(OpCode::Multiply, -1); break;
+            case TokenType::GREATER: Emit(OpCode::Greater, -1); break;
+            case TokenType::GREATER_EQUAL: Emit(OpCode::GreaterEqual, -1); break;
+            case TokenType::LESS: Emit(OpCode::Less, -1); break;
+            case TokenType::LESS_EQUAL: Emit(OpCode::LessEqual, -1); break;
+            case TokenType::EQUAL_EQUAL: Emit(OpCode::Equal, -1); return;
+            case TokenType::BANG_EQUAL: Emit(OpCode::NotEqual, -1); return;
+            default: Emit(OpCode::Binary, -1); break;
+        }
+        EmitToken(expr.op);
+    }
+
+    // The callee is checked before the arguments are evaluated, and skips the
+    // call leaving an error in its place if it cannot be called. Calls the
+    // resolver has checked need neither.
+    void VisitCall(const ExprCall& expr) override
+    {
+        CompileCall(expr, OpCode::Call);
+    }
+
+    void CompileCall(const ExprCall& expr, OpCode call)
+    {
+        Compile(expr.callee);
+        int argCount = (int)expr.args.size();
+        uint32_t skip = 0;
+        if (!expr.arityChecked)
+        {
+            Emit(OpCode::CheckCall);
+            EmitU16(argCount);
+            EmitToken(expr.paren);
+            skip = EmitJump();
+        }
+        for (Expr* arg : expr.args)
+            Compile(arg);
+        Emit(call, -argCount);
+        EmitU16(argCount);
+        if (!expr.arityChecked)
+            PatchJump(skip);
+    }
+
+    void VisitGet(const ExprGet& expr) override
+    {
+        Compile(expr.object);
+        Emit(OpCode::GetProperty);
+        EmitToken(expr.name);
+        EmitPropertyCache();
+    }
+
+    void VisitGrouping(const ExprGrouping& expr) override { Compile(expr.expr); }
+
+    void VisitLiteral(const ExprLiteral& expr) override
+    {
+        switch (expr.litType)
+        {
+            case LitType::Int:
+                Emit(OpCode::Int, 1);
+                EmitU32((uint32_t)expr.intValue);
+                break;
+            case LitType::Bool: Emit(expr.intValue ? OpCode::True : OpCode::False, 1); break;
+            case LitType::String:
+                Emit(OpCode::Constant, 1);
+                EmitU32((uint32_t)m_function->constants.size());
+                m_function->constants.push_back(Value(LoxString::Literal(expr.offset, expr.stringValue, expr.intValue), ValueType::STRING));
+                break;
+            default: Emit(OpCode::Nil, 1); break;
+        }
+    }
+
+    void VisitLogical(const ExprLogical& expr) override
+    {
+        Compile(expr.left);
+        Emit(expr.op->type == TokenType::OR ? OpCode::Or : OpCode::And, -1);
+        uint32_t end = EmitJump();
+        Compile(expr.right);
+        PatchJump(end);
+    }
+
+    void VisitSet(const ExprSet& expr) override
+    {
+        Compile(expr.object);
+        Compile(expr.value);
+        Emit(OpCode::SetProperty, -1);
+        EmitToken(expr.name);
+        EmitPropertyCache();
+    }
+
+    void VisitUnary(const ExprUnary& expr) override
+    {
+        Compile(expr.right);
+        switch (expr.op->type)
+        {
+            case TokenType::MINUS:
+                Emit(OpCode::Negate);
+                EmitToken(expr.op);
+                break;
+            case TokenType::BANG: Emit(OpCode::Not); break;
+            default:
+                Emit(OpCode::Pop, -1);
+                Emit(OpCode::Nil, 1);
+                break;
+        }
+    }
+
+    void VisitVariable(const ExprVariable& expr) override
+    {
+        EmitVariable(OpCode::GetLocal, OpCode::GetEnv, OpCode::GetGlobal, 1, expr.name, expr.depth, expr.idx);
+    }
+
+    void VisitBlock(const StmtBlock& stmt) override
+    {
+        m_frameSize = std::max(m_frameSize, stmt.frameSize);
+        if (stmt.envSlots > 0)
+        {
+            Emit(OpCode::PushEnv);
+            EmitU16(stmt.envSlots);
+        }
+        for (Stmt* inner : stmt.stmts)
+            Compile(inner);
+        if (stmt.envSlots > 0)
+            Emit(OpCode::PopEnv);
+    }
+
+    void VisitExpression(const StmtExpression& stmt) override
+    {
+        Compile(stmt.expr);
+        Emit(OpCode::Expression, -1);
+    }
+
+    void VisitFunction(const StmtFunction& stmt) override
+    {
+        BytecodeFunction* enclosing = m_function;
+        int depth = m_depth, frameSize = m_frameSize;
+
+        BytecodeFunction* function = BeginFunction();
+        function->name = stmt.name->index;
+        function->arity = (int)stmt.params.size();
+        function->envSlots = stmt.envSlots;
+        function->frameSize = stmt.frameSize;
+        for (Stmt* inner : stmt.body)
+            Compile(inner);
+        EndFunction();
+
+        m_function = enclosing;
+        m_depth = depth;
+        m_frameSize = frameSize;
+        Emit(OpCode::Closure, 1);
+        EmitU32((uint32_t)m_function->functions.size());
+        m_function->functions.push_back(function);
+        EmitDefine(stmt.name, stmt.depth, stmt.idx);
+    }
+
+    void VisitIf(const StmtIf& stmt) override
+    {
+        Compile(stmt.condition);
+        Emit(OpCode::JumpIfFalse, -1);
+        uint32_t elseBranch = EmitJump();
+        Compile(stmt.thenBranch);
+        if (stmt.elseBranch)
+        {
+            Emit(OpCode::Jump);
+            uint32_t end = EmitJump();
+            PatchJump(elseBranch);
+            Compile(stmt.elseBranch);
+            PatchJump(end);
+        }
+        else
+            PatchJump(elseBranch);
+    }
+
+    void VisitPrint(const StmtPrint& stmt) override
+    {
+        Compile(stmt.expr);
+        Emit(OpCode::Print, -1);
+    }
+
+    void VisitReturn(const StmtReturn& stmt) override
+    {
+        if (stmt.tailCall)
+            CompileCall(static_cast<const ExprCall&>(*stmt.value), OpCode::TailCall);
+        else
+            Compile(stmt.value);
+        Emit(OpCode::Return, -1);
+    }
+
+    void VisitVar(const StmtVar& stmt) override
+    {
+        Compile(stmt.init);
+        EmitDefine(stmt.name, stmt.depth, stmt.idx);
+    }
+
+    void VisitWhile(const StmtWhile& stmt) override
+    {
+        uint32_t start = (uint32_t)m_function->code.size();
+        Compile(stmt.condition);
+        Emit(OpCode::JumpIfFalse, -1);
+        uint32_t end = EmitJump();
+        Compile(stmt.body);
+        Emit(OpCode::Jump);
+        EmitU32(start);
+        PatchJump(end);
+    }
+
+    void VisitClass(const StmtClass& stmt) override
+    {
+        Emit(OpCode::Class, 1);
+        EmitToken(stmt.name);
+        EmitDefine(stmt.name, stmt.depth, stmt.idx);
+    }
+
+    BytecodeProgram& m_program;
+    BytecodeFunction* m_function = nullptr;
+    int m_depth = 0;// values on the stack at this point of the function
+    int m_frameSize = 0;// largest frame needed by a block so far
+};
+
+void bytecode_compile(const StmtPtrList& stmts, BytecodeProgram& program)
+{
+    BytecodeCompiler compiler(program);
+    compiler.BeginFunction();
+    for (Stmt* stmt : stmts)
+        compiler.Compile(stmt);
+    compiler.EndFunction();
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "value.h"
+#include "ast.h"
+
+// Instructions of the stack VM, see vm.cpp. Operands follow the opcode in the
+// code stream: slots, depths and argument counts are 16 bits, everything else
+// (constant, token and function indices, jump targets) 32 bits. Jump targets
+// are offsets from the start of the function's code.
+enum class OpCode : uint8_t
+{
+    Constant,// u32 constant
+    Nil, True, False,
+    Int,// i32 value
+    Pop,
+    Expression,// discards an expression statement's value, an error aborts the body
+    GetLocal, SetLocal, DefineLocal,// u16 slot
+    GetEnv, SetEnv,// u16 depth, u16 slot
+    DefineEnv,// u16 slot of the current environment
+    GetGlobal, SetGlobal,// u32 name token, u32 global slot
+    DefineGlobal,// u32 name token
+    GetProperty,// u32 name token, u32 property cache, replaces the instance with the field
+    SetProperty,// u32 name token, u32 property cache, pops the value and leaves it in place of the instance
+    // binary operators keep the operator token for errors and the generic path
+    Add, Subtract, Multiply, Greater, GreaterEqual, Less, LessEqual,// u32 token
+    Binary,// u32 token, any other operator
+    Equal, NotEqual,
+    Negate,// u32 token
+    Not,
+    Jump,// u32 target
+    JumpIfFalse,// u32 target, pops the condition
+    And, Or,// u32 target, jumps keeping the left operand or pops it
+    CheckCall,// u16 argument count, u32 paren token, u32 target past the call
+    Call,// u16 argument count
+    TailCall,// u16 argument count, a call in tail position that replaces the caller's frame
+    Closure,// u32 nested function
+    Class,// u32 name token
+    Print,
+    Return,
+    Exit,// end of the body, also where a failed statement ends up
+    PushEnv,// u16 slots
+    PopEnv,
+};
+
+// One compiled function, or the top level code of a program. Its frame on the
+// value stack holds frameSize locals (parameters first) followed by at most
+// maxStack temporaries.
+struct BytecodeFunction
+{
+    std::vector<uint8_t> code;
+    std::vector<Value> constants;
+    std::vector<const Token*> tokens;
+    std::vector<const BytecodeFunction*> functions;// declared in the body
+    mutable std::vector<PropertyCache> propertyCaches;// one per GetProperty and SetProperty
+    int name = -1;// symbol id
+    int arity = 0;
+    int envSlots = 0;
+    int frameSize = 0;
+    int maxStack = 0;
+};
+
+// Owns every function compiled from one unit, the top level code first
+struct BytecodeProgram
+{
+    std::vector<std::unique_ptr<BytecodeFunction>> functions;
+};
+
+// Compiles resolved statements. Functions keep pointing at the unit's tokens.
+void bytecode_compile(const StmtPtrList& stmts, BytecodeProgram& program);
+
+// Caller's state saved by a call in the VM
+struct BytecodeFrame
+{
+    const BytecodeFunction* function;
+    const uint8_t* ip;
+    size_t base;// first slot of the frame on the value stack, the callee is below
+    Ref<Environment> environment;// restored on return
+};
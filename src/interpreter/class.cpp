@@ -2,14 +2,286 @@
 #include "value.h"
 #include "ast.h"
 #include "lox.h"
+#include "source.h"
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <iterator>
 
 LoxObject::~LoxObject()
-{}
+{
+	if (gcGeneration)
+		gc_untrack(this);
+}
 
-LoxClass::LoxClass(const std::string& name)
+LoxClass::LoxClass(int name)
 	: name(name)
 {}
 
-LoxInstance::LoxInstance(std::shared_ptr<LoxClass>&& loxClass)
-	: loxClass(loxClass)
+static uint32_t HashString(const char* text, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i)
+		hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+	return hash;
+}
+
+// Strings shorter than this are copied on concatenation instead of becoming
+// rope nodes, which would cost more than the copy
+static const int RopeMinLength = 64;
+
+LoxString::LoxString(std::string&& text, bool interned)
+	: length((int)text.size())
+	, interned(interned)
+	, text(std::move(text))
+	, hash(HashString(this->text.data(), this->text.size()))
+	, left(nullptr)
+	, right(nullptr)
 {}
+
+LoxString::LoxString(LoxString* left, LoxString* right)
+	: length(left->length + right->length)
+	, interned(false)
+	, hash(0)
+	, left(left)
+	, right(right)
+{
+	left->Retain();
+	right->Retain();
+}
+
+static void Unintern(LoxString* string);
+
+// Ropes built in a loop are as deep as the loop was long, so children are
+// released with an explicit stack rather than by recursing
+LoxString::~LoxString()
+{
+	if (interned)
+		Unintern(this);
+	if (!left)
+		return;
+	std::vector<LoxString*> pending{ left, right };
+	while (!pending.empty())
+	{
+		LoxString* string = pending.back();
+		pending.pop_back();
+		if (--string->refCount > 0)
+			continue;
+		if (string->left)
+		{
+			pending.push_back(string->left);
+			pending.push_back(string->right);
+			string->left = string->right = nullptr;
+		}
+		delete string;
+	}
+}
+
+LoxString* LoxString::Concat(LoxString* left, LoxString* right)
+{
+	if (left->length + right->length < RopeMinLength)
+		return new LoxString(left->Text() + right->Text());
+	return new LoxString(left, right);
+}
+
+void LoxString::Flatten() const
+{
+	text.reserve(length);
+	std::vector<const LoxString*> pending{ right, left };
+	while (!pending.empty())
+	{
+		const LoxString* string = pending.back();
+		pending.pop_back();
+		if (string->left)
+		{
+			pending.push_back(string->right);
+			pending.push_back(string->left);
+		}
+		else
+			text += string->text;
+	}
+	hash = HashString(text.data(), text.size());
+
+	LoxString* children[] = { left, right };
+	left = right = nullptr;
+	for (LoxString* child : children)
+		child->Release();
+}
+
+// The intern table holds no references: strings remove themselves when
+// destroyed. It is never freed, as values kept until exit are released after
+// static destructors run.
+static std::unordered_multimap<uint32_t, LoxString*>& Interned()
+{
+	static auto* interned = new std::unordered_multimap<uint32_t, LoxString*>();
+	return *interned;
+}
+
+// Literals hold a reference while their source is registered
+static std::map<int, LoxString*> s_literals;// by source offset
+
+LoxString* LoxString::Intern(const char* text, int length)
+{
+	uint32_t hash = HashString(text, length);
+	auto range = Interned().equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+		if (it->second->text.compare(0, std::string::npos, text, length) == 0)
+			return it->second;
+
+	LoxString* string = new LoxString(std::string(text, length), true);
+	Interned().emplace(hash, string);
+	return string;
+}
+
+static void Unintern(LoxString* string)
+{
+	auto range = Interned().equal_range(string->Hash());
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (it->second == string)
+		{
+			Interned().erase(it);
+			return;
+		}
+	}
+}
+
+// a removed source's offsets are reused, so its literals are forgotten
+static void ForgetLiterals(int base, int length)
+{
+	auto first = s_literals.lower_bound(base);
+	auto last = s_literals.upper_bound(base + length);
+	for (auto it = first; it != last; ++it)
+		it->second->Release();
+	s_literals.erase(first, last);
+}
+
+LoxString* LoxString::Literal(int offset, const char* text, int length)
+{
+	auto item = s_literals.find(offset);
+	if (item != s_literals.end())
+		return item->second;
+	static bool registered = (source_on_remove(ForgetLiterals), true);
+	(void)registered;
+	LoxString* string = Intern(text, length);
+	string->Retain();
+	s_literals.emplace(offset, string);
+	return string;
+}
+
+bool LoxString::Equals(const LoxString& other) const
+{
+	if (this == &other)
+		return true;
+	if (interned && other.interned)
+		return false;
+	return length == other.length && Hash() == other.Hash() && Text() == other.Text();
+}
+
+LoxShape* LoxShape::Empty()
+{
+	static LoxShape* empty = new LoxShape();
+	return empty;
+}
+
+LoxShape::LoxShape(const LoxShape& parent, int name)
+	: slotCount(parent.slotCount + 1)
+	, m_slots(parent.m_slots)
+{
+	m_slots.emplace(name, parent.slotCount);
+}
+
+int LoxShape::Find(int name) const
+{
+	auto item = m_slots.find(name);
+	return item != m_slots.end() ? item->second : -1;
+}
+
+LoxShape* LoxShape::Add(int name)
+{
+	LoxShape*& next = m_transitions[name];
+	if (!next)
+		next = new LoxShape(*this, name);
+	return next;
+}
+
+LoxInstance::LoxInstance(LoxClass* loxClass)
+	: loxClass(loxClass)
+	, shape(LoxShape::Empty())
+{
+	loxClass->Retain();
+	gc_track(this);
+}
+
+// Instances chained through their fields, such as a long linked list, are
+// released with an explicit stack rather than by recursing
+LoxInstance::~LoxInstance()
+{
+	loxClass->Release();
+	std::vector<Value> pending(std::move(fields));
+	while (!pending.empty())
+	{
+		Value value = std::move(pending.back());
+		pending.pop_back();
+		if (value.type == ValueType::INSTANCE && value.objectValue->refCount == 1)
+		{
+			std::vector<Value>& children = value.GetInstance()->fields;
+			std::move(children.begin(), children.end(), std::back_inserter(pending));
+			children.clear();
+		}
+	}
+}
+
+bool LoxInstance::GetField(int name, PropertyCache& cache, Value& value) const
+{
+	if (const PropertyCache::Entry* entry = cache.Find(shape))
+	{
+		value = fields[entry->slot];
+		return true;
+	}
+	int slot = shape->Find(name);
+	if (slot < 0)
+		return false;
+	cache.Add(shape, shape, slot);
+	value = fields[slot];
+	return true;
+}
+
+void LoxInstance::SetField(int name, const Value& value, PropertyCache& cache)
+{
+	const PropertyCache::Entry* entry = cache.Find(shape);
+	if (!entry)
+	{
+		int slot = shape->Find(name);
+		LoxShape* next = slot < 0 ? shape->Add(name) : shape;
+		cache.Add(shape, next, slot < 0 ? shape->slotCount : slot);
+		if (slot < 0)
+		{
+			shape = next;
+			fields.push_back(value);
+		}
+		else
+			fields[slot] = value;
+		return;
+	}
+	if (entry->next != shape)
+	{
+		shape = entry->next;
+		fields.push_back(value);
+	}
+	else
+		fields[entry->slot] = value;
+}
+
+void LoxInstance::Trace(GcVisit visit, void* context)
+{
+	for (const Value& value : fields)
+		if (value.IsObject())
+			visit(value.objectValue, context);
+}
+
+void LoxInstance::ClearRefs()
+{
+	fields.clear();
+	shape = LoxShape::Empty();
+}
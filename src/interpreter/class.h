@@ -1,26 +1,124 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "gc.h"
 
 struct Interpreter;
 struct Value;
 struct ExprCall;
+struct PropertyCache;
 
+typedef void (*GcVisit)(LoxObject* object, void* context);
+
+// Heap objects are shared between Values by an intrusive reference count.
+// It is not atomic: values never cross threads. See gc.h for how they are
+// allocated and how cycles are collected.
 struct LoxObject
 {
+	LoxObject() : refCount(0), gcGeneration(0), gcRefs(0), gcPrev(nullptr), gcNext(nullptr) {}
 	virtual ~LoxObject();
+
+	static void* operator new(size_t size) { return gc_allocate(size); }
+	static void operator delete(void* ptr, size_t size) { gc_free(ptr, size); }
+
+	void Retain() { ++refCount; }
+	void Release() { if (--refCount == 0) delete this; }
+
+	// Objects that reference others call gc_track and report the references
+	// here, and drop them in ClearRefs when found to be part of a garbage cycle
+	virtual void Trace(GcVisit, void*) {}
+	virtual void ClearRefs() {}
+
+	int refCount;
+	// collector bookkeeping
+	int gcGeneration;// 0 if not tracked
+	int gcRefs;
+	LoxObject* gcPrev;
+	LoxObject* gcNext;
+};
+
+// Immutable string with its hash computed once. Interned strings are unique
+// per content, so two interned strings are equal only if they are the same
+// object.
+//
+// Concatenation is lazy: the result is a rope node referencing both halves,
+// so appending in a loop costs O(1) per step. A rope is flattened into one
+// buffer the first time its contents are observed.
+struct LoxString : public LoxObject
+{
+	LoxString(std::string&& text, bool interned = false);
+	~LoxString();
+
+	static LoxString* Intern(const char* text, int length);
+	// Interned string for a literal in the source, looked up by the offset of
+	// its text, which is unique while the source is registered (see source.h).
+	// The literal is kept alive until its source is removed.
+	static LoxString* Literal(int offset, const char* text, int length);
+	static LoxString* Concat(LoxString* left, LoxString* right);
+
+	bool Equals(const LoxString& other) const;
+	int Length() const { return length; }
+	const std::string& Text() const { if (left) Flatten(); return text; }
+	uint32_t Hash() const { if (left) Flatten(); return hash; }
+
+	const int length;
+	const bool interned;
+
+private:
+	LoxString(LoxString* left, LoxString* right);
+	void Flatten() const;
+
+	mutable std::string text;
+	mutable uint32_t hash;
+	mutable LoxString* left;// both set until a rope is flattened
+	mutable LoxString* right;
 };
 
 struct LoxClass : public LoxObject
 {
-	LoxClass(const std::string& name);
+	LoxClass(int name);
 
-	std::string name;
+	int name;// symbol id
+};
+
+// Layout of an instance's fields. Instances that had the same fields added in
+// the same order share a shape, which maps each field name to its slot in the
+// instance's field array. Adding a field follows a transition to the next
+// shape, so shapes form a tree rooted at Empty(). Shapes live until exit.
+struct LoxShape
+{
+	static LoxShape* Empty();
+
+	int Find(int name) const;// slot of field name, -1 if there is none
+	LoxShape* Add(int name);// the shape with field name appended
+
+	const int slotCount;
+
+private:
+	LoxShape() : slotCount(0) {}
+	LoxShape(const LoxShape& parent, int name);
+
+	std::unordered_map<int, int> m_slots;// symbol id to slot
+	std::unordered_map<int, LoxShape*> m_transitions;// symbol id of the added field to the next shape
 };
 
 struct LoxInstance : public LoxObject
 {
-	LoxInstance(std::shared_ptr<LoxClass>&& loxClass);
+	LoxInstance(LoxClass* loxClass);
+	~LoxInstance();
+
+	// Both check the access's inline cache for the instance's shape first and
+	// fill it in on a miss. GetField returns false if there is no field name.
+	bool GetField(int name, PropertyCache& cache, Value& value) const;
+	void SetField(int name, const Value& value, PropertyCache& cache);
+
+	void Trace(GcVisit visit, void* context) override;
+	void ClearRefs() override;
 
-	std::shared_ptr<LoxClass> loxClass;
+	LoxClass* loxClass;
+	LoxShape* shape;
+	std::vector<Value> fields;// one per slot of shape
 };
@@ -0,0 +1,470 @@
+#include "closure_compiler.h"
+#include "ast_visitors.h"
+#include "interpreter.h"
+#include "env.h"
+#include "function.h"
+
+// Each node becomes a lambda holding the callables of its children, with the
+// decisions the tree walker makes on every visit (operator, where a variable
+// lives, whether an operand is a literal) taken once here. Values, operator
+// semantics and error reporting are shared with the tree walker.
+
+// Binary operators with an integer fast path. Anything that is not two
+// numbers goes through Interpreter::Binary, which also reports the errors.
+struct AddOp { static Value Apply(int left, int right) { return left + right; } };
+struct SubtractOp { static Value Apply(int left, int right) { return left - right; } };
+struct MultiplyOp { static Value Apply(int left, int right) { return left * right; } };
+struct GreaterOp { static Value Apply(int left, int right) { return Value(left > right); } };
+struct GreaterEqualOp { static Value Apply(int left, int right) { return Value(left >= right); } };
+struct LessOp { static Value Apply(int left, int right) { return Value(left < right); } };
+struct LessEqualOp { static Value Apply(int left, int right) { return Value(left <= right); } };
+
+static bool IsIntLiteral(const Expr* expr)
+{
+    return expr->type == ExprType::Literal && static_cast<const ExprLiteral*>(expr)->litType == LitType::Int;
+}
+
+static bool IsStackVariable(const Expr* expr)
+{
+    return expr->type == ExprType::Variable && static_cast<const ExprVariable*>(expr)->depth == StackVariable;
+}
+
+// mirrors Interpreter::ExecuteBlock
+static bool RunList(Interpreter& interpreter, const std::vector<CompiledStmt>& stmts)
+{
+    for (const CompiledStmt& stmt : stmts)
+    {
+        if (!stmt(interpreter))
+            return false;
+        if (interpreter.hadReturn)
+            return true;
+    }
+    return true;
+}
+
+struct ClosureCompiler : public ConstExprVisitor<CompiledExpr>, ConstStmtVisitor<CompiledStmt>
+{
+    ClosureCompiler(CompiledProgram& program)
+        : m_program(program)
+    {}
+
+    CompiledExpr Compile(Expr* expr)
+    {
+        if (expr)
+            return VisitExpr(*expr);
+        return [](Interpreter&) { return Value(); };
+    }
+
+    CompiledStmt Compile(Stmt* stmt)
+    {
+        // a missing statement fails like it does in the tree walker
+        if (stmt)
+            return VisitStmt(*stmt);
+        return [](Interpreter&) { return false; };
+    }
+
+    std::vector<CompiledStmt> Compile(const StmtPtrList& stmts)
+    {
+        std::vector<CompiledStmt> compiled;
+        for (Stmt* stmt : stmts)
+            compiled.push_back(Compile(stmt));
+        return compiled;
+    }
+
+    template <typename Op>
+    CompiledExpr CompileArithmetic(const ExprBinary& expr)
+    {
+        const Token* op = expr.op;
+        if (IsIntLiteral(expr.right))
+        {
+            int constant = static_cast<const ExprLiteral*>(expr.right)->intValue;
+            if (IsStackVariable(expr.left))
+            {
+                // reads the slot in place instead of copying it out first
+                int idx = static_cast<const ExprVariable*>(expr.left)->idx;
+                return [=](Interpreter& interpreter)
+                {
+                    const Value& left = interpreter.stack[interpreter.frameBase + idx];
+                    if (left.type == ValueType::NUMBER)
+                        return Op::Apply(left.intValue, constant);
+                    return interpreter.Binary(op, left, Value(constant));
+                };
+            }
+            CompiledExpr left = Compile(expr.left);
+            return [=](Interpreter& interpreter)
+            {
+                Value value = left(interpreter);
+                if (value.type == ValueType::NUMBER)
+                    return Op::Apply(value.intValue, constant);
+                return interpreter.Binary(op, value, Value(constant));
+            };
+        }
+
+        CompiledExpr left = Compile(expr.left), right = Compile(expr.right);
+        return [=](Interpreter& interpreter)
+        {
+            Value leftValue = left(interpreter);
+            Value rightValue = right(interpreter);
+            if (leftValue.type == ValueType::NUMBER && rightValue.type == ValueType::NUMBER)
+                return Op::Apply(leftValue.intValue, rightValue.intValue);
+            return interpreter.Binary(op, leftValue, rightValue);
+        };
+    }
+
+    CompiledStmt CompileDefine(const Token* name, int depth, int idx, CompiledExpr value)
+    {
+        if (depth == StackVariable)
+        {
+            return [=](Interpreter& interpreter)
+            {
+                Value result = value(interpreter);
+                if (result.IsError())
+                    return false;
+                interpreter.stack[interpreter.frameBase + idx] = std::move(result);
+                return true;
+            };
+        }
+        else if (depth == GlobalVariable)
+        {
+            return [=](Interpreter& interpreter)
+            {
+                Value result = value(interpreter);
+                return result.IsValid() && interpreter.globals->DefineGlobal(name, result);
+            };
+        }
+        return [=](Interpreter& interpreter)
+        {
+            Value result = value(interpreter);
+            if (result.IsError())
+                return false;
+            interpreter.environment->Define(idx, result);
+            return true;
+        };
+    }
+
+    CompiledExpr VisitAssign(const ExprAssign& expr) override
+    {
+        CompiledExpr value = Compile(expr.value);
+        const Token* name = expr.name;
+        int depth = expr.depth, idx = expr.idx;
+        if (depth == StackVariable)
+        {
+            return [=](Interpreter& interpreter)
+            {
+                Value result = value(interpreter);
+                interpreter.stack[interpreter.frameBase + idx] = result;
+                return result;
+            };
+        }
+        else if (depth == GlobalVariable)
+        {
+            return [=](Interpreter& interpreter)
+            {
+                Value result = value(interpreter);
+                interpreter.globals->AssignGlobal(name, idx, result);
+                return result;
+            };
+        }
+        return [=](Interpreter& interpreter)
+        {
+            Value result = value(interpreter);
+            interpreter.environment->AssignAt(depth, idx, result);
+            return result;
+        };
+    }
+
+    CompiledExpr VisitBinary(const ExprBinary& expr) override
+    {
+        switch (expr.op->type)
+        {
+            case TokenType::PLUS: return CompileArithmetic<AddOp>(expr);
+            case TokenType::MINUS: return CompileArithmetic<SubtractOp>(expr);
+            case TokenType::STAR: return CompileArithmetic<MultiplyOp>(expr);
+            case TokenType::GREATER: return CompileArithmetic<GreaterOp>(expr);
+            case TokenType::GREATER_EQUAL: return CompileArithmetic<GreaterEqualOp>(expr);
+            case TokenType::LESS: return CompileArithmetic<LessOp>(expr);
+            case TokenType::LESS_EQUAL: return CompileArithmetic<LessEqualOp>(expr);
+            default: break;
+        }
+
+        CompiledExpr left = Compile(expr.left), right = Compile(expr.right);
+        if (expr.op->type == TokenType::EQUAL_EQUAL || expr.op->type == TokenType::BANG_EQUAL)
+        {
+            bool equal = expr.op->type == TokenType::EQUAL_EQUAL;
+            return [=](Interpreter& interpreter)
+            {
+                Value leftValue = left(interpreter);
+                Value rightValue = right(interpreter);
+                return Value(leftValue.Equals(rightValue) == equal);
+            };
+        }
+        const Token* op = expr.op;
+        return [=](Interpreter& interpreter)
+        {
+            Value leftValue = left(interpreter);
+            Value rightValue = right(interpreter);
+            return interpreter.Binary(op, leftValue, rightValue);
+        };
+    }
+
+    CompiledExpr VisitCall(const ExprCall& expr) override
+    {
+        CompiledExpr callee = Compile(expr.callee);
+        std::vector<CompiledExpr> args;
+        for (Expr* arg : expr.args)
+            args.push_back(Compile(arg));
+        const Token* paren = expr.paren;
+        int argCount = (int)args.size();
+        bool checked = expr.arityChecked != 0;
+        return [=](Interpreter& interpreter)
+        {
+            Value function = callee(interpreter);
+            if (!checked && !interpreter.CheckCall(function, argCount, paren))
+                return Value::Error;
+
+            size_t argBase = interpreter.stack.size();
+            for (const CompiledExpr& arg : args)
+                interpreter.stack.push_back(arg(interpreter));
+            return interpreter.CallOnStack(function, argBase);
+        };
+    }
+
+    // the lambda owns the access's inline cache
+    CompiledExpr VisitGet(const ExprGet& expr) override
+    {
+        CompiledExpr object = Compile(expr.object);
+        const Token* name = expr.name;
+        PropertyCache cache = PropertyCache();
+        return [=](Interpreter& interpreter) mutable
+        {
+            return interpreter.GetProperty(object(interpreter), name, cache);
+        };
+    }
+
+    CompiledExpr VisitGrouping(const ExprGrouping& expr) override { return Compile(expr.expr); }
+
+    CompiledExpr VisitLiteral(const ExprLiteral& expr) override
+    {
+        Value value(expr);
+        return [=](Interpreter&) { return value; };
+    }
+
+    CompiledExpr VisitLogical(const ExprLogical& expr) override
+    {
+        CompiledExpr left = Compile(expr.left), right = Compile(expr.right);
+        bool isOr = expr.op->type == TokenType::OR;
+        return [=](Interpreter& interpreter)
+        {
+            Value value = left(interpreter);
+            if (value.IsError())
+                return Value::Error;
+            if (value.IsTruthy() == isOr)
+                return value;
+            return right(interpreter);
+        };
+    }
+
+    CompiledExpr VisitSet(const ExprSet& expr) override
+    {
+        CompiledExpr object = Compile(expr.object), value = Compile(expr.value);
+        const Token* name = expr.name;
+        PropertyCache cache = PropertyCache();
+        return [=](Interpreter& interpreter) mutable
+        {
+            Value instance = object(interpreter);
+            Value result = value(interpreter);
+            return interpreter.SetProperty(instance, name, result, cache);
+        };
+    }
+
+    CompiledExpr VisitUnary(const ExprUnary& expr) override
+    {
+        CompiledExpr right = Compile(expr.right);
+        const Token* op = expr.op;
+        switch (op->type)
+        {
+            case TokenType::MINUS:
+                return [=](Interpreter& interpreter)
+                {
+                    Value value = right(interpreter);
+                    if (value.type == ValueType::NUMBER)
+                        return Value(-value.intValue);
+                    return interpreter.Unary(op, value);
+                };
+            case TokenType::BANG:
+                return [=](Interpreter& interpreter) { return Value(!right(interpreter).IsTruthy()); };
+            default:
+                return [=](Interpreter& interpreter) { return interpreter.Unary(op, right(interpreter)); };
+        }
+    }
+
+    CompiledExpr VisitVariable(const ExprVariable& expr) override
+    {
+        const Token* name = expr.name;
+        int depth = expr.depth, idx = expr.idx;
+        if (depth == StackVariable)
+            return [=](Interpreter& interpreter) { return interpreter.stack[interpreter.frameBase + idx]; };
+        else if (depth == GlobalVariable)
+            return [=](Interpreter& interpreter) { return interpreter.globals->GetGlobal(name, idx); };
+        return [=](Interpreter& interpreter) { return interpreter.environment->GetAt(depth, idx); };
+    }
+
+    CompiledStmt VisitBlock(const StmtBlock& stmt) override
+    {
+        std::vector<CompiledStmt> stmts = Compile(stmt.stmts);
+        int frameSize = stmt.frameSize, envSlots = stmt.envSlots;
+        if (envSlots == 0)
+        {
+            return [=](Interpreter& interpreter)
+            {
+                interpreter.ReserveFrame(frameSize);
+                return RunList(interpreter, stmts);
+            };
+        }
+        return [=](Interpreter& interpreter)
+        {
+            interpreter.ReserveFrame(frameSize);
+            Ref<Environment> parent = interpreter.environment;
+            interpreter.environment = new Environment(parent, envSlots);
+            bool result = RunList(interpreter, stmts);
+            interpreter.environment = parent;
+            return result;
+        };
+    }
+
+    CompiledStmt VisitExpression(const StmtExpression& stmt) override
+    {
+        CompiledExpr expr = Compile(stmt.expr);
+        return [=](Interpreter& interpreter) { return expr(interpreter).IsValid(); };
+    }
+
+    CompiledStmt VisitFunction(const StmtFunction& stmt) override
+    {
+        m_program.functions.emplace_back(new CompiledFunction());
+        CompiledFunction* compiled = m_program.functions.back().get();
+        compiled->envSlots = stmt.envSlots;
+        compiled->frameSize = stmt.frameSize;
+        std::vector<CompiledStmt> body = Compile(stmt.body);
+        compiled->body = [=](Interpreter& interpreter) { return RunList(interpreter, body); };
+
+        int name = stmt.name->index, arity = (int)stmt.params.size();
+        return CompileDefine(stmt.name, stmt.depth, stmt.idx, [=](Interpreter& interpreter)
+        {
+            Function* function = new Function(name, nullptr, nullptr, arity, interpreter.environment);
+            function->compiled = compiled;
+            return Value(function, ValueType::FUNCTION);
+        });
+    }
+
+    CompiledStmt VisitIf(const StmtIf& stmt) override
+    {
+        CompiledExpr condition = Compile(stmt.condition);
+        CompiledStmt thenBranch = Compile(stmt.thenBranch);
+        if (!stmt.elseBranch)
+        {
+            return [=](Interpreter& interpreter)
+            {
+                return !condition(interpreter).IsTruthy() || thenBranch(interpreter);
+            };
+        }
+        CompiledStmt elseBranch = Compile(stmt.elseBranch);
+        return [=](Interpreter& interpreter)
+        {
+            if (condition(interpreter).IsTruthy())
+                return thenBranch(interpreter);
+            return elseBranch(interpreter);
+        };
+    }
+
+    CompiledStmt VisitPrint(const StmtPrint& stmt) override
+    {
+        CompiledExpr expr = Compile(stmt.expr);
+        return [=](Interpreter& interpreter)
+        {
+            Value value = expr(interpreter);
+            if (value.IsError())
+                return false;
+            value.Print();
+            return true;
+        };
+    }
+
+    CompiledStmt VisitReturn(const StmtReturn& stmt) override
+    {
+        if (stmt.tailCall)
+        {
+            const ExprCall& call = static_cast<const ExprCall&>(*stmt.value);
+            CompiledExpr callee = Compile(call.callee);
+            std::vector<CompiledExpr> args;
+            for (Expr* arg : call.args)
+                args.push_back(Compile(arg));
+            const Token* paren = call.paren;
+            int argCount = (int)args.size();
+            bool checked = call.arityChecked != 0;
+            return [=](Interpreter& interpreter)
+            {
+                Value function = callee(interpreter);
+                if (!checked && !interpreter.CheckCall(function, argCount, paren))
+                {
+                    interpreter.returnValue = Value::Error;
+                    return false;
+                }
+
+                size_t argBase = interpreter.stack.size();
+                for (const CompiledExpr& arg : args)
+                    interpreter.stack.push_back(arg(interpreter));
+                return interpreter.ReturnCall(std::move(function), argBase);
+            };
+        }
+
+        CompiledExpr value = Compile(stmt.value);
+        return [=](Interpreter& interpreter)
+        {
+            interpreter.returnValue = value(interpreter);
+            if (interpreter.returnValue.IsError())
+                return false;
+            interpreter.hadReturn = true;
+            return true;
+        };
+    }
+
+    CompiledStmt VisitVar(const StmtVar& stmt) override
+    {
+        return CompileDefine(stmt.name, stmt.depth, stmt.idx, Compile(stmt.init));
+    }
+
+    CompiledStmt VisitWhile(const StmtWhile& stmt) override
+    {
+        CompiledExpr condition = Compile(stmt.condition);
+        CompiledStmt body = Compile(stmt.body);
+        return [=](Interpreter& interpreter)
+        {
+            while (condition(interpreter).IsTruthy())
+            {
+                if (!body(interpreter))
+                    return false;
+                if (interpreter.hadReturn)
+                    break;
+            }
+            return true;
+        };
+    }
+
+    CompiledStmt VisitClass(const StmtClass& stmt) override
+    {
+        int name = stmt.name->index;
+        return CompileDefine(stmt.name, stmt.depth, stmt.idx, [=](Interpreter&)
+        {
+            return Value(new LoxClass(name), ValueType::CLASS);
+        });
+    }
+
+    CompiledProgram& m_program;
+};
+
+void closure_compile(const StmtPtrList& stmts, CompiledProgram& program)
+{
+    ClosureCompiler compiler(program);
+    std::vector<CompiledStmt> compiled = compiler.Compile(stmts);
+    program.main = [=](Interpreter& interpreter) { return RunList(interpreter, compiled); };
+}
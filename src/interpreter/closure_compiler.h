@@ -0,0 +1,30 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <vector>
+#include "value.h"
+#include "ast.h"
+
+// Engine that turns each resolved node into a C++ callable once, so running
+// the program is a chain of indirect calls with no re-dispatch on the node
+// type. Statements return false on an error like the tree walker's visitors.
+typedef std::function<Value(Interpreter&)> CompiledExpr;
+typedef std::function<bool(Interpreter&)> CompiledStmt;
+
+struct CompiledFunction
+{
+    CompiledStmt body;
+    int envSlots = 0;
+    int frameSize = 0;
+};
+
+// Owns every function compiled from one unit
+struct CompiledProgram
+{
+    CompiledStmt main;
+    std::vector<std::unique_ptr<CompiledFunction>> functions;
+};
+
+// Compiles resolved statements. The callables keep pointing at the unit's
+// tokens but not at its AST.
+void closure_compile(const StmtPtrList& stmts, CompiledProgram& program);
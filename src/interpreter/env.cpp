@@ -2,49 +2,73 @@
 #include "value.h"
 #include "ast.h"
 #include "lox.h"
+#include "symbols.h"
 #include <cassert>
 
-Environment::Environment(const std::shared_ptr<Environment>& parent)
-	: m_parent(parent)
+// Slot arrays of freed environments, reused so that calls and blocks with
+// captured locals do not go to malloc for them. Environments are freed by
+// their last reference wherever that is dropped, so the pool is not owned by
+// an interpreter. It is never destructed, as environments may outlive it at
+// exit.
+static std::vector<std::vector<Value>>& SlotPool()
 {
+	static std::vector<std::vector<Value>>* pool = new std::vector<std::vector<Value>>();
+	return *pool;
 }
+static const size_t MaxPooledSlots = 64;// larger arrays go back to malloc
+static const size_t MaxPoolSize = 1024;
 
-Value Environment::GetAt(const Token* token, int depth) const 
+Environment::Environment(const Ref<Environment>& parent, int slotCount)
+	: m_parent(parent)
 {
-	const Environment* env = this;
-	for (int i = 0; i<depth && env; ++i)
-		env = env->m_parent.get();
-
-	if (!env)
+	std::vector<std::vector<Value>>& pool = SlotPool();
+	if (!pool.empty())
 	{
-		lox_error(*token, "Unable to resolve variable");
-		return Value::Error;
+		m_slots.swap(pool.back());
+		pool.pop_back();
 	}
+	m_slots.resize(slotCount);
+	gc_track(this);
+}
+
+Environment::~Environment()
+{
+	// clearing may free other environments, which return their arrays first
+	m_slots.clear();
+	std::vector<std::vector<Value>>& pool = SlotPool();
+	if (m_slots.capacity() > 0 && m_slots.capacity() <= MaxPooledSlots && pool.size() < MaxPoolSize)
+		pool.push_back(std::move(m_slots));
+}
+
+void Environment::Trace(GcVisit visit, void* context)
+{
+	for (const Value& value : m_slots)
+		if (value.IsObject())
+			visit(value.objectValue, context);
+	visit(m_parent.get(), context);
+}
+
+void Environment::ClearRefs()
+{
+	m_slots.clear();
+	m_defined.clear();
+	m_parent = nullptr;
+}
 
-	auto val = env->m_vars.find(token->stringLiteral);
-	if (val != env->m_vars.end())
-		return val->second;
+Value Environment::GetGlobal(const Token* token, int slot) const 
+{
+	if (IsDefined(slot))
+		return m_slots[slot];
 	
 	lox_error(*token, "Undefined variable");
     return Value::Error;
 }
 
-bool Environment::AssignAt(const Token* token, const Value& value, int depth) 
+bool Environment::AssignGlobal(const Token* token, int slot, const Value& value) 
 {
-	Environment* env = this;
-	for (int i = 0; i<depth && env; ++i)
-		env = env->m_parent.get();
-
-	if (!env)
+	if (IsDefined(slot))
 	{
-		lox_error(*token, "Unable to resolve variable");
-		return false;
-	}
-
-	auto val = env->m_vars.find(token->stringLiteral);
-	if (val != env->m_vars.end())
-	{
-		val->second = value;	
+		m_slots[slot] = value;	
 		return true;
 	}
 
@@ -52,12 +76,12 @@ bool Environment::AssignAt(const Token* token, const Value& value, int depth)
 	return false;
 }
 
-bool Environment::Define(const Token* token, const Value& value)
+bool Environment::DefineGlobal(const Token* token, const Value& value)
 {
-	auto val = m_vars.find(token->stringLiteral);
-	if (val == m_vars.end())
+	int slot = symbol_global_slot(token->index);
+	if (!IsDefined(slot))
 	{
-		m_vars.emplace(token->stringLiteral, value);
+		DefineSlot(slot, value);
 		return true;
 	}
 
@@ -65,8 +89,21 @@ bool Environment::Define(const Token* token, const Value& value)
 	return false;
 }
 
-void Environment::DefineFunction(const std::string& name, LoxFunction function, int arity, const StmtFunction* stmt, const std::shared_ptr<Environment>& closure)
+// name is a symbol id from symbol_intern
+Function* Environment::DefineFunction(int name, LoxFunction function, int arity)
 {
-	m_vars.emplace(name, Value(std::make_shared<Function>(name, function, stmt, arity, closure), ValueType::FUNCTION));
+	Function* func = new Function(name, function, nullptr, arity, Ref<Environment>());
+	DefineSlot(symbol_global_slot(name), Value(func, ValueType::FUNCTION));
+	return func;
 }
 
+void Environment::DefineSlot(int slot, const Value& value)
+{
+	if (slot >= (int)m_slots.size())
+	{
+		m_slots.resize(slot + 1);
+		m_defined.resize(slot + 1);
+	}
+	m_slots[slot] = value;
+	m_defined[slot] = true;
+}
@@ -1,22 +1,47 @@
 #pragma once
 #include <string>
-#include <unordered_map>
 #include <vector>
 #include "interpreter/value.h"
 
 struct Token;
 struct StmtFunction;
 
-class Environment
+// A scope at runtime. Locals live in a slot array sized by the resolver and
+// are addressed by the (depth, idx) pair it computed. The global environment
+// uses the same array indexed by symbol_global_slot, growing it as globals are
+// defined; a slot that has not been defined yet reports an undefined variable.
+class Environment : public LoxObject
 {
 public:
-    Environment(const std::shared_ptr<Environment>& parent = std::shared_ptr<Environment>());
-    Value GetAt(const Token* name, int depth) const;
-    bool AssignAt(const Token* name, const Value& value, int depth);
-    bool Define(const Token* name, const Value& value);
-    void DefineFunction(const std::string& name, LoxFunction function, int arity, const StmtFunction* stmt = nullptr, const std::shared_ptr<Environment>& closure = std::shared_ptr<Environment>());
+    Environment(const Ref<Environment>& parent = Ref<Environment>(), int slotCount = 0);
+    ~Environment();
+
+    const Value& GetAt(int depth, int idx) const { return Ancestor(depth)->m_slots[idx]; }
+    void AssignAt(int depth, int idx, const Value& value) { Ancestor(depth)->m_slots[idx] = value; }
+    void Define(int idx, const Value& value) { m_slots[idx] = value; }
+    const Ref<Environment>& Parent() const { return m_parent; }
+
+    Value GetGlobal(const Token* name, int slot) const;
+    bool AssignGlobal(const Token* name, int slot, const Value& value);
+    bool DefineGlobal(const Token* name, const Value& value);
+    Function* DefineFunction(int name, LoxFunction function, int arity);
+
+    void Trace(GcVisit visit, void* context) override;
+    void ClearRefs() override;
 
 private:
-    std::unordered_map<std::string,Value> m_vars;
-    std::shared_ptr<Environment> m_parent;
+    Environment* Ancestor(int depth) const
+    {
+        const Environment* env = this;
+        for (int i = 0; i < depth; ++i)
+            env = env->m_parent.get();
+        return const_cast<Environment*>(env);
+    }
+
+    bool IsDefined(int slot) const { return slot < (int)m_defined.size() && m_defined[slot]; }
+    void DefineSlot(int slot, const Value& value);
+
+    std::vector<Value> m_slots;
+    std::vector<bool> m_defined;// globals only
+    Ref<Environment> m_parent;
 };
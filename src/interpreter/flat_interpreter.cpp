@@ -0,0 +1,181 @@
+#include "interpreter.h"
+#include "lox.h"
+#include "env.h"
+#include "function.h"
+
+// Walks the flat AST. Mirrors the tree walker in interpreter.cpp, sharing
+// its operator, call and variable semantics.
+
+bool Interpreter::ExecuteFlat(const FlatAst& ast, uint32_t list)
+{
+    for (const uint32_t* it = ast.ListBegin(list); it != ast.ListEnd(list); ++it)
+    {
+        if (*it == NoNode || !ExecuteFlatStmt(ast, *it))
+            return false;
+        if (hadReturn)
+            return true;
+    }
+
+    return true;
+}
+
+bool Interpreter::ExecuteFlatStmt(const FlatAst& ast, NodeIdx idx)
+{
+    const FlatNode& node = ast[idx];
+    switch (node.kind)
+    {
+        case FlatKind::Block:
+        {
+            ReserveFrame((int)node.c);
+            if (node.b == 0)
+                return ExecuteFlat(ast, node.a);
+            Ref<Environment> parent = environment;
+            environment = new Environment(parent, (int)node.b);
+            bool result = ExecuteFlat(ast, node.a);
+            environment = parent;
+            return result;
+        }
+        case FlatKind::Expression:
+            return EvaluateFlat(ast, node.a).IsValid();
+        case FlatKind::Function:
+        {
+            const Token* name = ast.GetToken(node);
+            Function* function = new Function(name->index, nullptr, nullptr, (int)ast.ListSize(node.a), environment);
+            function->flatAst = &ast;
+            function->flatNode = idx;
+            return DefineVariable(name, (int)node.c, (int)node.d, Value(function, ValueType::FUNCTION));
+        }
+        case FlatKind::If:
+            if (EvaluateFlat(ast, node.a).IsTruthy())
+                return ExecuteFlatStmt(ast, node.b);
+            else if (node.c != NoNode)
+                return ExecuteFlatStmt(ast, node.c);
+            return true;
+        case FlatKind::Print:
+        {
+            Value value = EvaluateFlat(ast, node.a);
+            if (value.IsError())
+                return false;
+            value.Print();
+            return true;
+        }
+        case FlatKind::Return:
+            if (node.b)
+            {
+                const FlatNode& call = ast[node.a];
+                Value callee = EvaluateFlat(ast, call.a);
+                if (!call.c && !CheckCall(callee, (int)ast.ListSize(call.b), ast.GetToken(call)))
+                {
+                    returnValue = Value::Error;
+                    return false;
+                }
+
+                size_t argBase = stack.size();
+                for (const uint32_t* arg = ast.ListBegin(call.b); arg != ast.ListEnd(call.b); ++arg)
+                    stack.push_back(EvaluateFlat(ast, *arg));
+                return ReturnCall(std::move(callee), argBase);
+            }
+            returnValue = EvaluateFlat(ast, node.a);
+            if (returnValue.IsError())
+                return false;
+            hadReturn = true;
+            return true;
+        case FlatKind::Var:
+        {
+            Value value;
+            if (node.a != NoNode)
+                value = EvaluateFlat(ast, node.a);
+            if (value.IsError())
+                return false;
+            return DefineVariable(ast.GetToken(node), (int)node.b, (int)node.c, value);
+        }
+        case FlatKind::While:
+            while (EvaluateFlat(ast, node.a).IsTruthy())
+            {
+                if (!ExecuteFlatStmt(ast, node.b))
+                    return false;
+                if (hadReturn)
+                    break;
+            }
+            return true;
+        case FlatKind::Class:
+            return DefineClass(ast.GetToken(node), (int)node.b, (int)node.c);
+        default:
+            return false;
+    }
+}
+
+Value Interpreter::EvaluateFlat(const FlatAst& ast, NodeIdx idx)
+{
+    if (idx == NoNode)
+        return Value();
+
+    const FlatNode& node = ast[idx];
+    switch (node.kind)
+    {
+        case FlatKind::Assign:
+        {
+            Value value = EvaluateFlat(ast, node.a);
+            AssignVariable(ast.GetToken(node), value, (int)node.b, (int)node.c);
+            return value;
+        }
+        case FlatKind::Binary:
+        {
+            Value left = EvaluateFlat(ast, node.a);
+            Value right = EvaluateFlat(ast, node.b);
+            return Binary(ast.GetToken(node), left, right);
+        }
+        case FlatKind::Call:
+        {
+            Value callee = EvaluateFlat(ast, node.a);
+            if (!node.c && !CheckCall(callee, (int)ast.ListSize(node.b), ast.GetToken(node)))
+                return Value::Error;
+
+            size_t argBase = stack.size();
+            for (const uint32_t* arg = ast.ListBegin(node.b); arg != ast.ListEnd(node.b); ++arg)
+                stack.push_back(EvaluateFlat(ast, *arg));
+
+            return CallOnStack(callee, argBase);
+        }
+        case FlatKind::Get:
+            return GetProperty(EvaluateFlat(ast, node.a), ast.GetToken(node), ast.propertyCaches[node.b]);
+        case FlatKind::Grouping:
+            return EvaluateFlat(ast, node.a);
+        case FlatKind::Literal:
+            switch ((LitType)node.a)
+            {
+                case LitType::Int: return Value((int)node.b);
+                case LitType::Bool: return Value(node.b != 0);
+                case LitType::String: return Value(LoxString::Literal((int)node.d, ast.strings[node.c], (int)node.b), ValueType::STRING);
+                default:
+                case LitType::Nil: return Value();
+            }
+        case FlatKind::Logical:
+        {
+            Value left = EvaluateFlat(ast, node.a);
+            if (left.IsError())
+                return Value::Error;
+            if (ast.GetToken(node)->type == TokenType::OR)
+            {
+                if (left.IsTruthy()) return left;
+            }
+            else
+            {
+                if (!left.IsTruthy()) return left;
+            }
+            return EvaluateFlat(ast, node.b);
+        }
+        case FlatKind::Set:
+        {
+            Value object = EvaluateFlat(ast, node.a);
+            Value value = EvaluateFlat(ast, node.b);
+            return SetProperty(object, ast.GetToken(node), value, ast.propertyCaches[node.c]);
+        }
+        case FlatKind::Unary:
+            return Unary(ast.GetToken(node), EvaluateFlat(ast, node.a));
+        case FlatKind::Variable:
+            return GetVariable(ast.GetToken(node), (int)node.b, (int)node.c);
+        default:
+            return Value::Error;
+    }
+}
@@ -3,40 +3,119 @@
 #include "interpreter.h"
 #include "lox.h"
 #include "env.h"
+#include "flat_ast.h"
+#include "closure_compiler.h"
+#include <iterator>
 
-Function::Function(const std::string& name, LoxFunction function, const StmtFunction* stmt, int arity, const std::shared_ptr<Environment>& closure)
+Function::Function(int name, LoxFunction function, const StmtFunction* stmt, int arity, const Ref<Environment>& closure)
 	: name(name)
 	, function(function)
 	, stmt(stmt)
+	, flatAst(nullptr)
+	, flatNode(0)
+	, bytecode(nullptr)
+	, compiled(nullptr)
 	, closure(closure)
     , arity(arity)
-{}
+{
+    gc_track(this);
+}
 
-Value Function::Call(Interpreter& interpreter, const ExprCall& expr)
+void Function::Trace(GcVisit visit, void* context)
 {
-    if (arity != expr.args.size())
-    {
-        char buf[64];
-        std::snprintf(buf, 64, "Expected %d args but got %d", arity, (int)expr.args.size());
-        lox_error(*expr.paren, buf);
-        return Value::Error;
-    }
+    visit(closure.get(), context);
+}
 
-    std::vector<Value> args;
-    for (const ExprPtr& arg : expr.args)
-        args.push_back(interpreter.VisitExpr(*arg));
+void Function::ClearRefs()
+{
+    closure = nullptr;
+}
 
+Value Function::Call(Interpreter& interpreter, std::vector<Value>& args)
+{
     if (function)
     	return function(interpreter, args);
+    if (bytecode)
+        return interpreter.CallBytecode(*this, args);
 
-    interpreter.returnValue = Value();
-    interpreter.hadReturn = false;
-    std::shared_ptr<Environment> original = interpreter.environment;
-    interpreter.environment = std::make_shared<Environment>(closure);
-    for (int i = 0; i<args.size(); ++i)
-        interpreter.environment->Define(stmt->params[i], args[i]);
-        
-    interpreter.ExecuteBlock(stmt->body);  
+    size_t argBase = interpreter.stack.size();
+    for (Value& arg : args)
+        interpreter.stack.push_back(std::move(arg));
+    return Call(interpreter, argBase);
+}
+
+Value Function::Call(Interpreter& interpreter, size_t base)
+{
+    if (function || bytecode)
+    {
+        std::vector<Value> args(std::make_move_iterator(interpreter.stack.begin() + base), std::make_move_iterator(interpreter.stack.end()));
+        interpreter.stack.resize(base);
+        return Call(interpreter, args);
+    }
+
+    Ref<Environment> original = interpreter.environment;
+    size_t originalBase = interpreter.frameBase;
+    interpreter.frameBase = base;
+
+    // A return in tail position leaves the next function to run in
+    // interpreter.tailCallee, which then takes over this frame
+    Function* callee = this;
+    Value tailCallee;
+    for (;;)
+    {
+        interpreter.returnValue = Value();
+        interpreter.hadReturn = false;
+        int envSlots, frameSize;
+        if (callee->flatAst)
+        {
+            const FlatNode& body = (*callee->flatAst)[(*callee->flatAst)[callee->flatNode].b];
+            envSlots = (int)body.b;
+            frameSize = (int)body.c;
+        }
+        else if (callee->compiled)
+        {
+            envSlots = callee->compiled->envSlots;
+            frameSize = callee->compiled->frameSize;
+        }
+        else
+        {
+            envSlots = callee->stmt->envSlots;
+            frameSize = callee->stmt->frameSize;
+        }
+
+        // parameters are already the first slots of the frame, and are copied
+        // to the function's environment if it has captured locals
+        interpreter.stack.resize(base + frameSize);
+        if (envSlots > 0)
+        {
+            interpreter.environment = new Environment(callee->closure, envSlots);
+            for (int i = 0; i < callee->arity; ++i)
+                interpreter.environment->Define(i, interpreter.stack[base + i]);
+        }
+        else
+            interpreter.environment = callee->closure;
+
+        if (callee->flatAst)
+            interpreter.ExecuteFlat(*callee->flatAst, (*callee->flatAst)[(*callee->flatAst)[callee->flatNode].b].a);
+        else if (callee->compiled)
+            callee->compiled->body(interpreter);
+        else
+            interpreter.ExecuteBlock(callee->stmt->body);
+
+        if (!interpreter.tailCallee.IsObject())
+            break;
+        // the next function's arguments were left above this frame
+        tailCallee = std::move(interpreter.tailCallee);
+        callee = tailCallee.GetFunction();
+        size_t argBase = interpreter.tailArgBase;
+        size_t argCount = interpreter.stack.size() - argBase;
+        for (size_t i = 0; i < argCount; ++i)
+            interpreter.stack[base + i] = std::move(interpreter.stack[argBase + i]);
+        interpreter.stack.resize(base + argCount);
+    }
+
+    interpreter.stack.resize(base);
+    interpreter.frameBase = originalBase;
     interpreter.environment = original;
     interpreter.hadReturn = false;
 
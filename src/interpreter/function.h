@@ -2,6 +2,7 @@
 #include <memory>
 #include <vector>
 #include <string>
+#include <cstdint>
 #include "class.h"
 
 struct Value;
@@ -9,19 +10,33 @@ struct Interpreter;
 struct Expr;
 struct ExprCall;
 struct StmtFunction;
+struct FlatAst;
+struct BytecodeFunction;
+struct CompiledFunction;
 class Environment;
 
 typedef Value (*LoxFunction)(Interpreter& interpreter, std::vector<Value>& args);
 
 struct Function : public LoxObject
 {
-	Function(const std::string& name, LoxFunction function, const StmtFunction* stmt, int arity, const std::shared_ptr<Environment>& closure);
+	Function(int name, LoxFunction function, const StmtFunction* stmt, int arity, const Ref<Environment>& closure);
 
-    std::string name;
+    int name;// symbol id
     LoxFunction function;
     const StmtFunction* stmt;
-    std::shared_ptr<Environment> closure;
+    const FlatAst* flatAst;// set instead of stmt for functions declared in a flat AST
+    uint32_t flatNode;
+    const BytecodeFunction* bytecode;// set for functions compiled for the VM
+    const CompiledFunction* compiled;// set for functions built by closure_compile
+    Ref<Environment> closure;
     int arity;
 
-    Value Call(Interpreter& interpreter, const ExprCall& expr);
+    // arity has already been checked by Interpreter::CheckCall or the resolver
+    Value Call(Interpreter& interpreter, std::vector<Value>& args);
+    // The arguments are the values on the interpreter's stack from argBase up,
+    // and become the first slots of the function's frame without a copy
+    Value Call(Interpreter& interpreter, size_t argBase);
+
+    void Trace(GcVisit visit, void* context) override;
+    void ClearRefs() override;
 };
@@ -0,0 +1,323 @@
+#include "gc.h"
+#include "class.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <vector>
+
+// Blocks are aligned to their size, so the block an object lives in is found
+// by masking its address. The header takes the first bytes of the block.
+struct GcBlock
+{
+    char* bump;
+    char* end;
+    int live;// objects allocated in the block that have not been freed
+};
+
+static const size_t GcAlignment = 16;
+static const int YoungGeneration = 1;
+static const int OldGeneration = 2;
+// Blocks kept for reuse once empty, beyond this they go back to the system
+static const size_t MaxFreeBlocks = 4;
+// Block memory below this never triggers a full collection
+static const size_t MinFullCollectionBytes = 4 << 20;
+
+// Sentinel of a circular list of the tracked objects in one generation
+struct GcList
+{
+    LoxObject head;
+    size_t count = 0;
+
+    GcList() { head.gcPrev = head.gcNext = &head; }
+    bool IsEmpty() const { return head.gcNext == &head; }
+};
+
+struct GcStats
+{
+    int youngCollections = 0, fullCollections = 0;
+    size_t freed = 0;
+    double totalPause = 0.0, maxPause = 0.0;
+    size_t blocks = 0, maxBlocks = 0;
+};
+
+static GcOptions s_options;
+static size_t s_blockSize = 0;
+static GcBlock* s_current = nullptr;
+static std::vector<GcBlock*> s_freeBlocks;
+static GcList s_young, s_old;
+static size_t s_youngAllocations = 0;
+static size_t s_oldAfterFull = 0;
+static size_t s_blocksAfterFull = 0;
+static bool s_collecting = false;
+static GcStats s_stats;
+
+void gc_configure(const GcOptions& options)
+{
+    s_options = options;
+    if (s_blockSize == 0)
+    {
+        size_t size = 4096;
+        while (size < (size_t)options.blockKB * 1024)
+            size *= 2;
+        s_blockSize = size;
+    }
+}
+
+static void* AllocateAligned(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, size);
+#else
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, size, size) == 0 ? ptr : nullptr;
+#endif
+}
+
+static void FreeAligned(void* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static void ResetBlock(GcBlock* block)
+{
+    block->bump = (char*)block + ((sizeof(GcBlock) + GcAlignment - 1) & ~(GcAlignment - 1));
+    block->end = (char*)block + s_blockSize;
+    block->live = 0;
+}
+
+static GcBlock* NewBlock()
+{
+    GcBlock* block;
+    if (!s_freeBlocks.empty())
+    {
+        block = s_freeBlocks.back();
+        s_freeBlocks.pop_back();
+    }
+    else
+    {
+        block = (GcBlock*)AllocateAligned(s_blockSize);
+        if (!block)
+            throw std::bad_alloc();
+        s_stats.blocks++;
+        if (s_stats.blocks > s_stats.maxBlocks)
+            s_stats.maxBlocks = s_stats.blocks;
+    }
+    ResetBlock(block);
+    return block;
+}
+
+static void RetireBlock(GcBlock* block)
+{
+    if (s_freeBlocks.size() < MaxFreeBlocks)
+        s_freeBlocks.push_back(block);
+    else
+    {
+        FreeAligned(block);
+        s_stats.blocks--;
+    }
+}
+
+static bool IsLarge(size_t size)
+{
+    return size > s_blockSize / 8;
+}
+
+void* gc_allocate(size_t size)
+{
+    if (s_blockSize == 0)
+        gc_configure(s_options);
+    size = (size + GcAlignment - 1) & ~(GcAlignment - 1);
+    if (IsLarge(size))
+    {
+        if (void* ptr = malloc(size))
+            return ptr;
+        throw std::bad_alloc();
+    }
+
+    if (!s_current || s_current->bump + size > s_current->end)
+    {
+        // a full block is left to be retired when its last object dies
+        if (s_current && s_current->live == 0)
+            ResetBlock(s_current);
+        else
+            s_current = NewBlock();
+    }
+    void* ptr = s_current->bump;
+    s_current->bump += size;
+    s_current->live++;
+    return ptr;
+}
+
+void gc_free(void* ptr, size_t size)
+{
+    size = (size + GcAlignment - 1) & ~(GcAlignment - 1);
+    if (IsLarge(size))
+    {
+        free(ptr);
+        return;
+    }
+
+    GcBlock* block = (GcBlock*)((uintptr_t)ptr & ~(uintptr_t)(s_blockSize - 1));
+    if (--block->live > 0)
+        return;
+    if (block == s_current)
+        ResetBlock(block);
+    else
+        RetireBlock(block);
+}
+
+static void Link(GcList& list, LoxObject* object)
+{
+    object->gcPrev = list.head.gcPrev;
+    object->gcNext = &list.head;
+    list.head.gcPrev->gcNext = object;
+    list.head.gcPrev = object;
+    list.count++;
+}
+
+// A dead old object keeps its whole block from being reused, so the old
+// generation is also collected once the blocks in use have grown, even if it
+// has few objects
+static bool OldGenerationGrown()
+{
+    size_t base = std::max(s_oldAfterFull, (size_t)s_options.youngThreshold);
+    if (s_old.count > base + base * s_options.oldGrowthPercent / 100)
+        return true;
+    size_t blocks = std::max(s_blocksAfterFull, MinFullCollectionBytes / s_blockSize);
+    return s_stats.blocks > blocks + blocks * s_options.oldGrowthPercent / 100;
+}
+
+void gc_track(LoxObject* object)
+{
+    // the new object is not linked yet, so it cannot be mistaken for garbage
+    if (++s_youngAllocations >= (size_t)s_options.youngThreshold && !s_collecting)
+        gc_collect(OldGenerationGrown());
+    object->gcGeneration = YoungGeneration;
+    Link(s_young, object);
+}
+
+void gc_untrack(LoxObject* object)
+{
+    object->gcPrev->gcNext = object->gcNext;
+    object->gcNext->gcPrev = object->gcPrev;
+    (object->gcGeneration == YoungGeneration ? s_young : s_old).count--;
+    object->gcGeneration = 0;
+}
+
+static void SubtractRef(LoxObject* object, void* context)
+{
+    if (object && object->gcGeneration != 0 && object->gcGeneration <= *(int*)context)
+        object->gcRefs--;
+}
+
+struct MarkContext
+{
+    int generation;
+    std::vector<LoxObject*> pending;
+};
+
+static void MarkRef(LoxObject* object, void* context)
+{
+    MarkContext& mark = *(MarkContext*)context;
+    if (object && object->gcGeneration != 0 && object->gcGeneration <= mark.generation && object->gcRefs == 0)
+    {
+        object->gcRefs = 1;
+        mark.pending.push_back(object);
+    }
+}
+
+static void Collect(int generation)
+{
+    // the old generation is collected together with the young one
+    std::vector<LoxObject*> objects;
+    objects.reserve(s_young.count + (generation == OldGeneration ? s_old.count : 0));
+    for (GcList* list : { &s_young, &s_old })
+    {
+        if (list == &s_old && generation != OldGeneration)
+            break;
+        for (LoxObject* object = list->head.gcNext; object != &list->head; object = object->gcNext)
+        {
+            // an object still being constructed is not counted yet but alive
+            object->gcRefs = object->refCount > 0 ? object->refCount : 1;
+            objects.push_back(object);
+        }
+    }
+
+    for (LoxObject* object : objects)
+        object->Trace(SubtractRef, &generation);
+
+    MarkContext mark{ generation, {} };
+    for (LoxObject* object : objects)
+        if (object->gcRefs > 0)
+            mark.pending.push_back(object);
+    while (!mark.pending.empty())
+    {
+        LoxObject* object = mark.pending.back();
+        mark.pending.pop_back();
+        object->Trace(MarkRef, &mark);
+    }
+
+    // Unreachable objects are kept alive while their references are dropped,
+    // so the cycles come apart without freeing anything mid-way
+    std::vector<LoxObject*> garbage;
+    for (LoxObject* object : objects)
+        if (object->gcRefs == 0)
+            garbage.push_back(object);
+    for (LoxObject* object : garbage)
+        object->Retain();
+    for (LoxObject* object : garbage)
+        object->ClearRefs();
+    for (LoxObject* object : garbage)
+        object->Release();
+    s_stats.freed += garbage.size();
+
+    // survivors are promoted
+    while (!s_young.IsEmpty())
+    {
+        LoxObject* object = s_young.head.gcNext;
+        gc_untrack(object);
+        object->gcGeneration = OldGeneration;
+        Link(s_old, object);
+    }
+}
+
+void gc_collect(bool full)
+{
+    if (s_collecting)
+        return;
+    s_collecting = true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    Collect(full ? OldGeneration : YoungGeneration);
+    s_youngAllocations = 0;
+    if (full)
+    {
+        s_oldAfterFull = s_old.count;
+        s_blocksAfterFull = s_stats.blocks;
+        s_stats.fullCollections++;
+    }
+    else
+        s_stats.youngCollections++;
+
+    double pause = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    s_stats.totalPause += pause;
+    if (pause > s_stats.maxPause)
+        s_stats.maxPause = pause;
+    s_collecting = false;
+}
+
+void gc_print_stats()
+{
+    fprintf(stderr, "gc: %d young and %d full collections, %zu objects freed in cycles\n",
+        s_stats.youngCollections, s_stats.fullCollections, s_stats.freed);
+    fprintf(stderr, "gc: pauses %.3f ms total, %.3f ms max\n", s_stats.totalPause * 1000.0, s_stats.maxPause * 1000.0);
+    fprintf(stderr, "gc: %zu KB blocks in use, %zu KB peak, %zu young and %zu old tracked objects\n",
+        s_stats.blocks * s_blockSize / 1024, s_stats.maxBlocks * s_blockSize / 1024, s_young.count, s_old.count);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+
+struct LoxObject;
+
+// Heap for LoxObjects.
+//
+// Objects are reference counted, so acyclic garbage is freed as soon as its
+// last Value or Ref goes. Memory comes from a bump pointer in aligned blocks,
+// and a block is reused once every object allocated in it has died, so short
+// lived objects (call environments, temporary strings) do not go to malloc.
+// Objects never move, as the interpreters keep raw pointers to them in C++
+// frames.
+//
+// Garbage cycles, such as a closure stored in the environment it captures,
+// are found by a generational collector. Objects that can reference other
+// objects are tracked in a young or an old generation. A collection subtracts
+// from each tracked object's count the references held by other objects in
+// the generations being collected. Anything with references left over is held
+// from outside them: by the interpreter's value stack, its current or global
+// environment, an older object or a C++ temporary. Those objects are the
+// roots, and whatever they cannot reach is garbage. Young collections promote
+// their survivors to the old generation, which is collected in full once it
+// or the allocation blocks in use have grown by oldGrowthPercent since the
+// last full collection: a dead old object keeps its whole block from being
+// reused.
+struct GcOptions
+{
+    int blockKB = 256;// allocation block size, rounded up to a power of two
+    int youngThreshold = 10000;// tracked allocations between young collections
+    int oldGrowthPercent = 100;// old generation or block growth between full collections
+    bool stats = false;// report collections and pause times, see gc_print_stats
+};
+
+// Must be called before the first object is allocated to change block size
+void gc_configure(const GcOptions& options);
+void gc_collect(bool full);
+void gc_print_stats();
+
+void* gc_allocate(size_t size);
+void gc_free(void* ptr, size_t size);
+void gc_track(LoxObject* object);
+void gc_untrack(LoxObject* object);
+
+// Counted reference to an object held outside a Value
+template <typename T>
+class Ref
+{
+public:
+    Ref(T* object = nullptr) : m_object(object) { if (m_object) m_object->Retain(); }
+    Ref(const Ref& other) : Ref(other.m_object) {}
+    Ref(Ref&& other) : m_object(other.m_object) { other.m_object = nullptr; }
+    ~Ref() { if (m_object) m_object->Release(); }
+
+    Ref& operator=(const Ref& other)
+    {
+        Ref copy(other);
+        std::swap(m_object, copy.m_object);
+        return *this;
+    }
+
+    Ref& operator=(Ref&& other)
+    {
+        std::swap(m_object, other.m_object);
+        return *this;
+    }
+
+    T* get() const { return m_object; }
+    T* operator->() const { return m_object; }
+    T& operator*() const { return *m_object; }
+    explicit operator bool() const { return m_object != nullptr; }
+    bool operator==(const Ref& other) const { return m_object == other.m_object; }
+    bool operator!=(const Ref& other) const { return m_object != other.m_object; }
+
+private:
+    T* m_object;
+};
@@ -2,28 +2,13 @@
 #include "lox.h"
 #include "env.h"
 #include "class.h"
+#include "function.h"
 
-Interpreter::Interpreter(const std::shared_ptr<Environment>& env)
+Interpreter::Interpreter(const Ref<Environment>& env)
     : environment(env)
     , globals(env)
 {}
 
-static bool IsEqual(const Value& left, const Value& right)
-{
-    if (left.type == ValueType::NIL && right.type == ValueType::NIL) return true;
-    if (left.type == ValueType::NIL) return false;
-    
-    if (left.type == ValueType::STRING || right.type == ValueType::STRING)
-    {
-        if (left.type != ValueType::STRING || right.type != ValueType::STRING)
-            return false;
-
-        return left.stringValue == right.stringValue;
-    }
-
-    return left.intValue == right.intValue;
-}
-
 static bool CheckNumbers(const Token* op, const Value& left, const Value& right, bool error = true)
 {
     if (left.type == ValueType::NUMBER && right.type == ValueType::NUMBER)
@@ -41,28 +26,107 @@ static bool CheckNumbers(const Token* op, const Value& operand)
     return false;
 }
 
+static bool IsIntLiteral(const Expr* expr)
+{
+    return expr->type == ExprType::Literal && static_cast<const ExprLiteral*>(expr)->litType == LitType::Int;
+}
+
+// Picks the specialization for the operand types of the first evaluation
+static BinaryQuick QuickenBinary(const ExprBinary& expr, const Value& left, const Value& right)
+{
+    if (left.type == ValueType::NUMBER && right.type == ValueType::NUMBER)
+    {
+        bool literal = IsIntLiteral(expr.right);
+        switch (expr.op->type)
+        {
+            case TokenType::PLUS: return literal ? BinaryQuick::AddIntLiteral : BinaryQuick::AddInt;
+            case TokenType::MINUS: return literal ? BinaryQuick::SubtractIntLiteral : BinaryQuick::SubtractInt;
+            case TokenType::STAR: return literal ? BinaryQuick::MultiplyIntLiteral : BinaryQuick::MultiplyInt;
+            case TokenType::GREATER: return literal ? BinaryQuick::GreaterIntLiteral : BinaryQuick::GreaterInt;
+            case TokenType::GREATER_EQUAL: return literal ? BinaryQuick::GreaterEqualIntLiteral : BinaryQuick::GreaterEqualInt;
+            case TokenType::LESS: return literal ? BinaryQuick::LessIntLiteral : BinaryQuick::LessInt;
+            case TokenType::LESS_EQUAL: return literal ? BinaryQuick::LessEqualIntLiteral : BinaryQuick::LessEqualInt;
+            default: break;
+        }
+    }
+    else if (expr.op->type == TokenType::PLUS && left.type == ValueType::STRING && right.type == ValueType::STRING)
+        return BinaryQuick::ConcatString;
+    return BinaryQuick::Generic;
+}
+
 Value Interpreter::VisitBinary(const ExprBinary& expr)
 {
     Value left = VisitExpr(*expr.left);
+
+// a literal right operand is read straight from its node
+#define QUICK_INT(name, symbol) \
+    case BinaryQuick::name##Int: \
+    { \
+        Value right = VisitExpr(*expr.right); \
+        if (left.type == ValueType::NUMBER && right.type == ValueType::NUMBER) \
+            return left.intValue symbol right.intValue; \
+        expr.quick = BinaryQuick::Generic; \
+        return Binary(expr.op, left, right); \
+    } \
+    case BinaryQuick::name##IntLiteral: \
+        if (left.type == ValueType::NUMBER) \
+            return left.intValue symbol static_cast<const ExprLiteral*>(expr.right)->intValue; \
+        expr.quick = BinaryQuick::Generic; \
+        return Binary(expr.op, left, VisitExpr(*expr.right));
+
+    switch (expr.quick)
+    {
+        QUICK_INT(Add, +)
+        QUICK_INT(Subtract, -)
+        QUICK_INT(Multiply, *)
+        QUICK_INT(Greater, >)
+        QUICK_INT(GreaterEqual, >=)
+        QUICK_INT(Less, <)
+        QUICK_INT(LessEqual, <=)
+        case BinaryQuick::ConcatString:
+        {
+            Value right = VisitExpr(*expr.right);
+            if (left.type == ValueType::STRING && right.type == ValueType::STRING)
+                return Value(LoxString::Concat(static_cast<LoxString*>(left.objectValue), static_cast<LoxString*>(right.objectValue)), ValueType::STRING);
+            expr.quick = BinaryQuick::Generic;
+            return Binary(expr.op, left, right);
+        }
+        case BinaryQuick::Uninitialized:
+        {
+            Value right = VisitExpr(*expr.right);
+            expr.quick = QuickenBinary(expr, left, right);
+            return Binary(expr.op, left, right);
+        }
+        case BinaryQuick::Generic:
+            break;
+    }
+
+#undef QUICK_INT
+
     Value right = VisitExpr(*expr.right);
-    switch (expr.op->type)
+    return Binary(expr.op, left, right);
+}
+
+Value Interpreter::Binary(const Token* op, const Value& left, const Value& right)
+{
+    switch (op->type)
     {
         case TokenType::MINUS:
-            if (CheckNumbers(expr.op, left, right))
+            if (CheckNumbers(op, left, right))
                 return left.intValue - right.intValue;
             break;
         case TokenType::PLUS:
-            if (CheckNumbers(expr.op, left, right, false))
+            if (CheckNumbers(op, left, right, false))
                 return left.intValue + right.intValue;
             else if (left.type == ValueType::STRING)
             {
-                const char* rightStr = nullptr;
+                Value rightStr;
                 switch (right.type)
                 {
                     case ValueType::NIL: return left;
-                    case ValueType::BOOL: rightStr = right.intValue ? "true" : "false"; break;
-                    case ValueType::NUMBER: rightStr = std::to_string(right.intValue).c_str(); break;
-                    case ValueType::STRING: rightStr = right.stringValue.c_str(); break;
+                    case ValueType::BOOL: rightStr = Value(LoxString::Intern(right.intValue ? "true" : "false", right.intValue ? 4 : 5), ValueType::STRING); break;
+                    case ValueType::NUMBER: rightStr = Value(std::to_string(right.intValue)); break;
+                    case ValueType::STRING: rightStr = right; break;
                     case ValueType::FUNCTION:
                     case ValueType::CLASS:
                     case ValueType::INSTANCE:
@@ -70,61 +134,163 @@ Value Interpreter::VisitBinary(const ExprBinary& expr)
                         return Value::Error;
                 }
 
-                return Value(left.stringValue + rightStr);
+                return Value(LoxString::Concat(static_cast<LoxString*>(left.objectValue), static_cast<LoxString*>(rightStr.objectValue)), ValueType::STRING);
             }
             break;
         case TokenType::STAR:
-            if (CheckNumbers(expr.op, left, right))
+            if (CheckNumbers(op, left, right))
                 return left.intValue * right.intValue;
             break;
         case TokenType::GREATER:
-            if (CheckNumbers(expr.op, left, right))
+            if (CheckNumbers(op, left, right))
                 return Value(left.intValue > right.intValue);
             break;
         case TokenType::GREATER_EQUAL:
-            if (CheckNumbers(expr.op, left, right))
+            if (CheckNumbers(op, left, right))
                 return Value(left.intValue >= right.intValue);
             break;
         case TokenType::LESS:
-            if (CheckNumbers(expr.op, left, right))
+            if (CheckNumbers(op, left, right))
                 return Value(left.intValue < right.intValue);
             break;
         case TokenType::LESS_EQUAL:
-            if (CheckNumbers(expr.op, left, right))
+            if (CheckNumbers(op, left, right))
                 return Value(left.intValue <= right.intValue);
             break;
         case TokenType::BANG_EQUAL:
-            return !IsEqual(left, right);
+            return !left.Equals(right);
         case TokenType::EQUAL_EQUAL:
-            return IsEqual(left, right);
+            return left.Equals(right);
         default:
-            lox_error(*expr.op, "Unknown operand");
+            lox_error(*op, "Unknown operand");
             break;
     }
     return Value::Error;
 }
 
+// Arguments are evaluated straight onto the value stack, where they become
+// the first slots of the callee's frame
 Value Interpreter::VisitCall(const ExprCall& expr) 
 {
     Value callee = VisitExpr(*expr.callee);
-    
-    if (callee.type == ValueType::FUNCTION && callee.objectValue)
-        return callee.GetFunction()->Call(*this, expr);
-    else if (callee.type == ValueType::CLASS && callee.objectValue)
+    if (!expr.arityChecked && !CheckCall(callee, (int)expr.args.size(), expr.paren))
+        return Value::Error;
+
+    size_t argBase = stack.size();
+    for (const ExprPtr& arg : expr.args)
+        stack.push_back(VisitExpr(*arg));
+
+    return CallOnStack(callee, argBase);
+}
+
+bool Interpreter::CheckCall(const Value& callee, int argCount, const Token* paren)
+{
+    if (callee.type == ValueType::FUNCTION)
     {
-        if (expr.args.size() != 0)
-        {
-            lox_error(*expr.paren, "Expected 0 args");
-            return Value::Error;
-        }
+        int arity = callee.GetFunction()->arity;
+        if (arity == argCount)
+            return true;
+
+        char buf[64];
+        std::snprintf(buf, 64, "Expected %d args but got %d", arity, argCount);
+        lox_error(*paren, buf);
+        return false;
+    }
+    else if (callee.type == ValueType::CLASS)
+    {
+        if (argCount == 0)
+            return true;
+
+        lox_error(*paren, "Expected 0 args");
+        return false;
+    }
+
+    lox_error(*paren, "Callee is not a function");
+    return false;
+}
+
+Value Interpreter::Call(const Value& callee, std::vector<Value>& args)
+{
+    if (callee.type == ValueType::FUNCTION)
+        return callee.GetFunction()->Call(*this, args);
+
+    return Value(new LoxInstance(callee.GetClass()), ValueType::INSTANCE);
+}
+
+Value Interpreter::CallOnStack(const Value& callee, size_t argBase)
+{
+    if (callee.type == ValueType::FUNCTION)
+        return callee.GetFunction()->Call(*this, argBase);
+
+    stack.resize(argBase);
+    return Value(new LoxInstance(callee.GetClass()), ValueType::INSTANCE);
+}
 
-        return Value(std::make_shared<LoxInstance>(std::static_pointer_cast<LoxClass>(callee.objectValue)), ValueType::INSTANCE);
+// Returns the result of a call in tail position. Lox functions are not called
+// here but left in tailCallee, so that Function::Call runs them in the frame
+// of the function returning, and tail recursion needs no native stack.
+bool Interpreter::ReturnCall(Value&& callee, size_t argBase)
+{
+    const Function* function = callee.type == ValueType::FUNCTION ? callee.GetFunction() : nullptr;
+    if (function && !function->function && !function->bytecode)
+    {
+        tailCallee = std::move(callee);
+        tailArgBase = argBase;
+        returnValue = Value();
     }
+    else
+    {
+        returnValue = CallOnStack(callee, argBase);
+        if (returnValue.IsError())
+            return false;
+    }
+    hadReturn = true;
+    return true;
+}
 
-    lox_error(*expr.paren, "Callee is not a function");
+Value Interpreter::VisitGet(const ExprGet& expr)
+{
+    return GetProperty(VisitExpr(*expr.object), expr.name, expr.cache);
+}
+
+Value Interpreter::VisitSet(const ExprSet& expr)
+{
+    Value object = VisitExpr(*expr.object);
+    Value value = VisitExpr(*expr.value);
+    return SetProperty(object, expr.name, value, expr.cache);
+}
+
+Value Interpreter::GetProperty(const Value& object, const Token* name, PropertyCache& cache)
+{
+    if (object.type != ValueType::INSTANCE)
+    {
+        if (object.IsValid())
+            lox_error(*name, "Only instances have properties");
+        return Value::Error;
+    }
+
+    Value value;
+    if (object.GetInstance()->GetField(name->index, cache, value))
+        return value;
+    lox_error(*name, "Undefined property");
     return Value::Error;
 }
 
+Value Interpreter::SetProperty(const Value& object, const Token* name, const Value& value, PropertyCache& cache)
+{
+    if (object.type != ValueType::INSTANCE)
+    {
+        if (object.IsValid())
+            lox_error(*name, "Only instances have fields");
+        return Value::Error;
+    }
+    if (value.IsError())
+        return Value::Error;
+
+    object.GetInstance()->SetField(name->index, value, cache);
+    return value;
+}
+
 Value Interpreter::VisitGrouping(const ExprGrouping& group)
 {
     return VisitExpr(*group.expr);
@@ -135,25 +301,40 @@ Value Interpreter::VisitLiteral(const ExprLiteral& lit)
     return Value(lit);
 }
 
-static bool IsTruthy(const Value& val)
-{
-    if (val.type == ValueType::NIL) return false;
-    if (val.type == ValueType::STRING) return true;
-    return val.intValue > 0;
-}
-
 Value Interpreter::VisitLogical(const ExprLogical& expr) 
 {
     Value left = VisitExpr(*expr.left);
+    switch (expr.quick)
+    {
+        case LogicalQuick::AndBool:
+            if (left.type == ValueType::BOOL)
+                return left.intValue ? VisitExpr(*expr.right) : left;
+            expr.quick = LogicalQuick::Generic;
+            break;
+        case LogicalQuick::OrBool:
+            if (left.type == ValueType::BOOL)
+                return left.intValue ? left : VisitExpr(*expr.right);
+            expr.quick = LogicalQuick::Generic;
+            break;
+        case LogicalQuick::Uninitialized:
+            if (left.type != ValueType::BOOL)
+                expr.quick = LogicalQuick::Generic;
+            else
+                expr.quick = expr.op->type == TokenType::OR ? LogicalQuick::OrBool : LogicalQuick::AndBool;
+            break;
+        case LogicalQuick::Generic:
+            break;
+    }
+
     if (left.IsError())
         return Value::Error;
     if (expr.op->type == TokenType::OR)
     {
-        if (IsTruthy(left)) return left;
+        if (left.IsTruthy()) return left;
     }
     else
     {
-        if (!IsTruthy(left)) return left;
+        if (!left.IsTruthy()) return left;
     }
     
     return VisitExpr(*expr.right);
@@ -162,13 +343,38 @@ Value Interpreter::VisitLogical(const ExprLogical& expr)
 Value Interpreter::VisitUnary(const ExprUnary& expr)
 {
     Value right = VisitExpr(*expr.right);
-    switch (expr.op->type)
+    switch (expr.quick)
+    {
+        case UnaryQuick::NegateInt:
+            if (right.type == ValueType::NUMBER)
+                return -right.intValue;
+            expr.quick = UnaryQuick::Generic;
+            break;
+        case UnaryQuick::Not:
+            return !right.IsTruthy();
+        case UnaryQuick::Uninitialized:
+            if (expr.op->type == TokenType::BANG)
+                expr.quick = UnaryQuick::Not;
+            else if (expr.op->type == TokenType::MINUS && right.type == ValueType::NUMBER)
+                expr.quick = UnaryQuick::NegateInt;
+            else
+                expr.quick = UnaryQuick::Generic;
+            break;
+        case UnaryQuick::Generic:
+            break;
+    }
+    return Unary(expr.op, right);
+}
+
+Value Interpreter::Unary(const Token* op, const Value& right)
+{
+    switch (op->type)
     {
         case TokenType::MINUS:
-            if (CheckNumbers(expr.op, right))
+            if (CheckNumbers(op, right))
                 return -right.intValue;
         case TokenType::BANG:
-            return !IsTruthy(right);
+            return !right.IsTruthy();
         default:
             break;
     }
@@ -177,22 +383,50 @@ Value Interpreter::VisitUnary(const ExprUnary& expr)
 
 Value Interpreter::VisitVariable(const ExprVariable& expr) 
 {
-    if (expr.depth == GlobalVariable)
-        return globals->GetAt(expr.name, 0);
-    else
-        return environment->GetAt(expr.name, expr.depth);
+    return GetVariable(expr.name, expr.depth, expr.idx);
 }
 
 Value Interpreter::VisitAssign(const ExprAssign& expr)
 {
     Value value = VisitExpr(*expr.value);
-    if (expr.depth == GlobalVariable)
-        globals->AssignAt(expr.name, value, 0);
-    else
-        environment->AssignAt(expr.name, value, expr.depth);
+    AssignVariable(expr.name, value, expr.depth, expr.idx);
     return value;
 }
 
+Value Interpreter::GetVariable(const Token* name, int depth, int idx)
+{
+    if (depth == StackVariable)
+        return stack[frameBase + idx];
+    else if (depth == GlobalVariable)
+        return globals->GetGlobal(name, idx);
+    else
+        return environment->GetAt(depth, idx);
+}
+
+bool Interpreter::AssignVariable(const Token* name, const Value& value, int depth, int idx)
+{
+    if (depth == StackVariable)
+        stack[frameBase + idx] = value;
+    else if (depth == GlobalVariable)
+        return globals->AssignGlobal(name, idx, value);
+    else
+        environment->AssignAt(depth, idx, value);
+    return true;
+}
+
+// depth is where the resolver placed the declaration: a stack slot, the
+// current environment (0) or the globals
+bool Interpreter::DefineVariable(const Token* name, int depth, int idx, const Value& value)
+{
+    if (depth == StackVariable)
+        stack[frameBase + idx] = value;
+    else if (depth == GlobalVariable)
+        return globals->DefineGlobal(name, value);
+    else
+        environment->Define(idx, value);
+    return true;
+}
+
 bool Interpreter::VisitExpression(const StmtExpression& expr) 
 {
     return VisitExpr(*expr.expr).IsValid();
@@ -205,7 +439,7 @@ bool Interpreter::VisitVar(const StmtVar& stmt)
         value = VisitExpr(*stmt.init);
     if (value.IsError())
         return false;
-    return environment->Define(stmt.name, value);
+    return DefineVariable(stmt.name, stmt.depth, stmt.idx, value);
 }
 
 bool Interpreter::ExecuteBlock(const StmtPtrList& stmts)
@@ -223,8 +457,11 @@ bool Interpreter::ExecuteBlock(const StmtPtrList& stmts)
 
 bool Interpreter::VisitBlock(const StmtBlock& stmt) 
 {
-    std::shared_ptr<Environment> parent = environment;
-    environment = std::make_shared<Environment>(parent);
+    ReserveFrame(stmt.frameSize);
+    if (stmt.envSlots == 0)
+        return ExecuteBlock(stmt.stmts);
+    Ref<Environment> parent = environment;
+    environment = new Environment(parent, stmt.envSlots);
     bool result = ExecuteBlock(stmt.stmts);
     environment = parent;
     return result;
@@ -232,13 +469,13 @@ bool Interpreter::VisitBlock(const StmtBlock& stmt)
 
 bool Interpreter::VisitFunction(const StmtFunction& stmt) 
 {
-    environment->DefineFunction(stmt.name->stringLiteral, nullptr, stmt.params.size(), &stmt, environment);
-    return true;
+    Function* function = new Function(stmt.name->index, nullptr, &stmt, (int)stmt.params.size(), environment);
+    return DefineVariable(stmt.name, stmt.depth, stmt.idx, Value(function, ValueType::FUNCTION));
 }
 
 bool Interpreter::VisitIf(const StmtIf& stmt) 
 {
-	if (IsTruthy(VisitExpr(*stmt.condition)))
+	if (VisitExpr(*stmt.condition).IsTruthy())
 		return VisitStmt(*stmt.thenBranch);
 	else if (stmt.elseBranch)
 		return VisitStmt(*stmt.elseBranch);
@@ -256,7 +493,23 @@ bool Interpreter::VisitPrint(const StmtPrint& expr)
 
 bool Interpreter::VisitReturn(const StmtReturn& stmt) 
 {
-    returnValue = VisitExpr(*stmt.value);
+    if (stmt.tailCall)
+    {
+        const ExprCall& call = static_cast<const ExprCall&>(*stmt.value);
+        Value callee = VisitExpr(*call.callee);
+        if (!call.arityChecked && !CheckCall(callee, (int)call.args.size(), call.paren))
+        {
+            returnValue = Value::Error;
+            return false;
+        }
+
+        size_t argBase = stack.size();
+        for (const ExprPtr& arg : call.args)
+            stack.push_back(VisitExpr(*arg));
+        return ReturnCall(std::move(callee), argBase);
+    }
+
+    returnValue = stmt.value ? VisitExpr(*stmt.value) : Value();
     if (returnValue.IsError())
         return false;
     hadReturn = true;
@@ -265,18 +518,22 @@ bool Interpreter::VisitReturn(const StmtReturn& stmt)
 
 bool Interpreter::VisitWhile(const StmtWhile& stmt) 
 {
-	while (IsTruthy(VisitExpr(*stmt.condition)))
+	while (VisitExpr(*stmt.condition).IsTruthy())
     {
 		if (!VisitStmt(*stmt.body))
             return false;
+        if (hadReturn)
+            break;
     }
     return true;
 }
 
 bool Interpreter::VisitClass(const StmtClass& stmt)
 {
-    if (!environment->Define(stmt.name, Value()))
-        return false;
-    return environment->AssignAt(stmt.name, Value(std::make_shared<LoxClass>(stmt.name->lexeme), ValueType::CLASS), GlobalVariable);
+    return DefineClass(stmt.name, stmt.depth, stmt.idx);
+}
 
+bool Interpreter::DefineClass(const Token* name, int depth, int idx)
+{
+    return DefineVariable(name, depth, idx, Value(new LoxClass(name->index), ValueType::CLASS));
 }
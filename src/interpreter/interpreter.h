@@ -2,19 +2,25 @@
 
 #include "ast_visitors.h"
 #include "value.h"
+#include "flat_ast.h"
+#include "bytecode.h"
+#include "gc.h"
 #include <memory>
+#include <vector>
 
 class Environment;
 
 struct Interpreter : public ConstStmtVisitor<bool>, ConstExprVisitor<Value>
 {
-    Interpreter(const std::shared_ptr<Environment>& env);
+    Interpreter(const Ref<Environment>& env);
 
     Value VisitBinary(const ExprBinary& expr) override;
     Value VisitCall(const ExprCall& expr) override;
+    Value VisitGet(const ExprGet& expr) override;
     Value VisitGrouping(const ExprGrouping& group) override;
     Value VisitLiteral(const ExprLiteral& lit) override;
     Value VisitLogical(const ExprLogical& expr) override;
+    Value VisitSet(const ExprSet& expr) override;
     Value VisitUnary(const ExprUnary& expr) override;
     Value VisitVariable(const ExprVariable& expr) override;
     Value VisitAssign(const ExprAssign& expr) override;
@@ -30,8 +36,46 @@ struct Interpreter : public ConstStmtVisitor<bool>, ConstExprVisitor<Value>
     bool VisitWhile(const StmtWhile& stmt) override;
     bool VisitClass(const StmtClass& stmt) override;
 
+    // Semantics shared by the tree and flat AST walkers
+    Value Binary(const Token* op, const Value& left, const Value& right);
+    Value Unary(const Token* op, const Value& right);
+    bool CheckCall(const Value& callee, int argCount, const Token* paren);
+    Value Call(const Value& callee, std::vector<Value>& args);
+    // the arguments are the values on the stack from argBase up, see Function::Call
+    Value CallOnStack(const Value& callee, size_t argBase);
+    bool ReturnCall(Value&& callee, size_t argBase);
+    Value GetProperty(const Value& object, const Token* name, PropertyCache& cache);
+    Value SetProperty(const Value& object, const Token* name, const Value& value, PropertyCache& cache);
+    Value GetVariable(const Token* name, int depth, int idx);
+    bool AssignVariable(const Token* name, const Value& value, int depth, int idx);
+    bool DefineVariable(const Token* name, int depth, int idx, const Value& value);
+    bool DefineClass(const Token* name, int depth, int idx);
+    // top level code has no call to size its frame, so blocks grow it on entry
+    void ReserveFrame(int frameSize)
+    {
+        if (stack.size() < frameBase + frameSize)
+            stack.resize(frameBase + frameSize);
+    }
+
+    // Flat AST walker, see flat_interpreter.cpp
+    bool ExecuteFlat(const FlatAst& ast, uint32_t list);
+    bool ExecuteFlatStmt(const FlatAst& ast, NodeIdx idx);
+    Value EvaluateFlat(const FlatAst& ast, NodeIdx idx);
+
+    // Bytecode VM, see vm.cpp
+    bool ExecuteBytecode(const BytecodeProgram& program);
+    Value CallBytecode(Function& function, std::vector<Value>& args);
+    void EnterBytecode(const BytecodeFunction& function, const Ref<Environment>& closure, size_t base, int argCount);
+    Value RunBytecode(size_t exitDepth);
+
     Value returnValue;
-    std::shared_ptr<Environment> environment;
-    std::shared_ptr<Environment> globals;
+    Ref<Environment> environment;
+    Ref<Environment> globals;
+    std::vector<Value> stack;// frames of locals that are not captured, see StackVariable
+    size_t frameBase = 0;
     bool hadReturn = false;
+    Value tailCallee;// Lox function left by a return in tail position for Function::Call to run next
+    size_t tailArgBase = 0;// its arguments are on the stack from here up
+    std::vector<BytecodeFrame> frames;// calls in progress in the VM
+    size_t stackTop = 0;// end of the VM's values while it calls out to C++
 };
@@ -1,39 +1,36 @@
 #include "value.h"
 #include "ast.h"
+#include "symbols.h"
+
+static_assert(sizeof(Value) <= 16, "Value should stay a tag and one word");
 
 const Value Value::Error = Value(ValueType::ERROR);
 
-Value::Value()
-    : type(ValueType::NIL)
-    , intValue(0)
-{}
-Value::Value(bool value)
-    : type(ValueType::BOOL)
-    , intValue(value)
-{}
-Value::Value(int value)
-    : type(ValueType::NUMBER)
-    , intValue(value)
-{}
-Value::Value(const std::string& value)
+Value::Value(std::string&& value)
     : type(ValueType::STRING)
-    , stringValue(value)
-    , intValue(0)
-{}
-Value::Value(std::shared_ptr<LoxObject>&& object, ValueType type)
+    , objectValue(new LoxString(std::move(value)))
+{
+    objectValue->Retain();
+}
+// takes a reference to object, which is freed with its last value
+Value::Value(LoxObject* object, ValueType type)
     : type(type)
-    , intValue(0)
     , objectValue(object)
-{}
+{
+    objectValue->Retain();
+}
 Value::Value(const ExprLiteral& literal)
-    : stringValue(literal.stringValue)
-    , intValue(literal.intValue)
+    : intValue(literal.intValue)
 {
     switch (literal.litType)
     {
         case LitType::Int: type = ValueType::NUMBER; break;
         case LitType::Bool: type = ValueType::BOOL; break;
-        case LitType::String: type = ValueType::STRING; break;
+        case LitType::String:
+            type = ValueType::STRING;
+            objectValue = LoxString::Literal(literal.offset, literal.stringValue, literal.intValue);
+            objectValue->Retain();
+            break;
         default:
         case LitType::Nil: type = ValueType::NIL; break;
     }
@@ -43,19 +40,30 @@ Value::Value(ValueType type)
     , intValue(0)
 {}
 
-Function* Value::GetFunction() 
-{ 
-    return static_cast<Function*>(objectValue.get());
+bool Value::IsTruthy() const
+{
+    if (type == ValueType::NIL) return false;
+    if (IsObject()) return type == ValueType::STRING;
+    return intValue > 0;
 }
 
-LoxClass* Value::GetClass()
-{ 
-    return static_cast<LoxClass*>(objectValue.get()); 
-}
+bool Value::Equals(const Value& other) const
+{
+    if (type == ValueType::NIL && other.type == ValueType::NIL) return true;
+    if (type == ValueType::NIL) return false;
+    
+    if (type == ValueType::STRING || other.type == ValueType::STRING)
+    {
+        if (type != ValueType::STRING || other.type != ValueType::STRING)
+            return false;
+
+        return GetString().Equals(other.GetString());
+    }
 
-LoxInstance* Value::GetInstance() 
-{ 
-    return static_cast<LoxInstance*>(objectValue.get()); 
+    // other objects have no immediate and compare as 0
+    int left = IsObject() ? 0 : intValue;
+    int right = other.IsObject() ? 0 : other.intValue;
+    return left == right;
 }
 
 void Value::Print() const
@@ -69,19 +77,19 @@ void Value::Print() const
             printf("%d\n", intValue);
             break;
         case ValueType::STRING:
-            printf("%s\n", stringValue.c_str());
+            printf("%s\n", GetString().Text().c_str());
             break;
         case ValueType::NIL:
             printf("nil\n");
             break;
         case ValueType::FUNCTION:
-            printf("func %s\n", objectValue ? static_cast<const Function*>(objectValue.get())->name.c_str() : "<nil>");
+            printf("func %s\n", objectValue ? symbol_name(static_cast<const Function*>(objectValue)->name).c_str() : "<nil>");
             break;
         case ValueType::CLASS:
-            printf("class %s\n", objectValue ? static_cast<const LoxClass*>(objectValue.get())->name.c_str() : "<nil>");
+            printf("class %s\n", objectValue ? symbol_name(static_cast<const LoxClass*>(objectValue)->name).c_str() : "<nil>");
             break;
         case ValueType::INSTANCE:
-            printf("instance %s\n", objectValue ? static_cast<const LoxInstance*>(objectValue.get())->loxClass->name.c_str() : "<nil>");
+            printf("instance %s\n", objectValue ? symbol_name(static_cast<const LoxInstance*>(objectValue)->loxClass->name).c_str() : "<nil>");
             break;
         case ValueType::ERROR:
             printf("<error>\n");
@@ -1,10 +1,13 @@
 #pragma once
 #include <string>
+#include <cstdint>
 #include "function.h"
 
-enum class ValueType
+enum class ValueType : uint8_t
 {
-    NIL, BOOL, NUMBER, STRING, FUNCTION, CLASS, INSTANCE, ERROR
+    NIL, BOOL, NUMBER, ERROR,
+    // heap objects, held through objectValue
+    STRING, FUNCTION, CLASS, INSTANCE
 };
 
 struct Value;
@@ -12,31 +15,88 @@ struct Interpreter;
 struct ExprLiteral;
 struct LoxClass;
 
+// A type tag and either an immediate or a pointer to a reference counted heap
+// object, 16 bytes in all. Copying an immediate is a plain copy; only object
+// values touch the reference count.
 struct Value
 {
     static const Value Error;
 
-    Value();
-    Value(bool value);
-    Value(int value);
-    Value(const std::string& value);
-    Value(std::shared_ptr<LoxObject>&& function, ValueType type);
+    Value() : type(ValueType::NIL), intValue(0) {}
+    Value(bool value) : type(ValueType::BOOL), intValue(value) {}
+    Value(int value) : type(ValueType::NUMBER), intValue(value) {}
+    Value(std::string&& value);
+    Value(LoxObject* object, ValueType type);
     Value(const ExprLiteral& literal);
+
+    Value(const Value& other)
+        : type(other.type)
+        , objectValue(other.objectValue)
+    {
+        if (IsObject())
+            objectValue->Retain();
+    }
+
+    Value(Value&& other)
+        : type(other.type)
+        , objectValue(other.objectValue)
+    {
+        other.type = ValueType::NIL;
+        other.objectValue = nullptr;
+    }
+
+    ~Value()
+    {
+        if (IsObject())
+            objectValue->Release();
+    }
+
+    Value& operator=(const Value& other)
+    {
+        if (other.IsObject())
+            other.objectValue->Retain();
+        if (IsObject())
+            objectValue->Release();
+        type = other.type;
+        objectValue = other.objectValue;
+        return *this;
+    }
+
+    Value& operator=(Value&& other)
+    {
+        if (this != &other)
+        {
+            if (IsObject())
+                objectValue->Release();
+            type = other.type;
+            objectValue = other.objectValue;
+            other.type = ValueType::NIL;
+            other.objectValue = nullptr;
+        }
+        return *this;
+    }
+
 private:
     explicit Value(ValueType type);
 public:
 
     ValueType type;
-    std::string stringValue;
-    int intValue;
-    std::shared_ptr<LoxObject> objectValue;
+    union
+    {
+        int intValue;
+        LoxObject* objectValue;
+    };
 
-    Function* GetFunction();
-    LoxClass* GetClass();
-    LoxInstance* GetInstance();
+    Function* GetFunction() const { return static_cast<Function*>(objectValue); }
+    LoxClass* GetClass() const { return static_cast<LoxClass*>(objectValue); }
+    LoxInstance* GetInstance() const { return static_cast<LoxInstance*>(objectValue); }
+    const LoxString& GetString() const { return *static_cast<LoxString*>(objectValue); }
 
     void Print() const;
+    bool IsTruthy() const;
+    bool Equals(const Value& other) const;
     int ToInt() const;
+    bool IsObject() const { return type >= ValueType::STRING; }
     bool IsValid() const { return type != ValueType::ERROR; }
     bool IsError() const { return type == ValueType::ERROR; }
 };
@@ -0,0 +1,383 @@
+#include "interpreter.h"
+#include "lox.h"
+#include "env.h"
+#include "function.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+// Stack VM running the code from bytecode.cpp. Calls between compiled
+// functions push a BytecodeFrame instead of recursing in C++. Values,
+// operator semantics and error reporting are shared with the tree walker.
+//
+// A failed statement ends the function body like it does in the walkers, so
+// the call returns whatever is in returnValue.
+
+static inline uint16_t ReadU16(const uint8_t*& ip)
+{
+    uint16_t value;
+    memcpy(&value, ip, 2);
+    ip += 2;
+    return value;
+}
+
+static inline uint32_t ReadU32(const uint8_t*& ip)
+{
+    uint32_t value;
+    memcpy(&value, ip, 4);
+    ip += 4;
+    return value;
+}
+
+bool Interpreter::ExecuteBytecode(const BytecodeProgram& program)
+{
+    // the slot below the frame stands in for the callee
+    EnterBytecode(*program.functions[0], environment, stackTop + 1, 0);
+    RunBytecode(frames.size() - 1);
+    return true;
+}
+
+Value Interpreter::CallBytecode(Function& function, std::vector<Value>& args)
+{
+    size_t callee = stackTop;
+    if (stack.size() < callee + 1 + args.size())
+        stack.resize(callee + 1 + args.size());
+    stack[callee] = Value(&function, ValueType::FUNCTION);
+    std::move(args.begin(), args.end(), stack.begin() + callee + 1);
+    EnterBytecode(*function.bytecode, function.closure, callee + 1, (int)args.size());
+    return RunBytecode(frames.size() - 1);
+}
+
+// The arguments are already in place as the first slots of the frame
+void Interpreter::EnterBytecode(const BytecodeFunction& function, const Ref<Environment>& closure, size_t base, int argCount)
+{
+    size_t needed = base + function.frameSize + function.maxStack;
+    if (stack.size() < needed)
+        stack.resize(std::max(needed, stack.size() * 2));
+    frames.push_back(BytecodeFrame{ &function, function.code.data(), base, environment });
+    if (function.envSlots > 0)
+    {
+        environment = new Environment(closure, function.envSlots);
+        for (int i = 0; i < argCount; ++i)
+            environment->Define(i, stack[base + i]);
+    }
+    else
+        environment = closure;
+    returnValue = Value();
+    stackTop = base + function.frameSize;
+}
+
+// Runs until the frame at exitDepth returns, and returns its result
+Value Interpreter::RunBytecode(size_t exitDepth)
+{
+    BytecodeFrame* frame;
+    const BytecodeFunction* function;
+    const uint8_t* code;
+    const uint8_t* ip;
+    Value* slots;
+    Value* sp = stack.data() + stackTop;
+
+#define LOAD_FRAME() \
+    frame = &frames.back(); \
+    function = frame->function; \
+    code = function->code.data(); \
+    ip = frame->ip; \
+    slots = stack.data() + frame->base
+
+#define TOKEN() function->tokens[ReadU32(ip)]
+
+// numbers take the fast path, anything else goes through Interpreter::Binary
+#define BINARY_OP(resultType, op) \
+    { \
+        const Token* token = TOKEN(); \
+        if (sp[-2].type == ValueType::NUMBER && sp[-1].type == ValueType::NUMBER) \
+        { \
+            sp[-2].type = resultType; \
+            sp[-2].intValue = sp[-2].intValue op sp[-1].intValue; \
+            --sp; \
+        } \
+        else \
+        { \
+            Value result = Binary(token, sp[-2], sp[-1]); \
+            *--sp = Value(); \
+            sp[-1] = std::move(result); \
+        } \
+        break; \
+    }
+
+    LOAD_FRAME();
+    for (;;)
+    {
+        switch ((OpCode)*ip++)
+        {
+            case OpCode::Constant: *sp++ = function->constants[ReadU32(ip)]; break;
+            case OpCode::Nil: *sp++ = Value(); break;
+            case OpCode::True: *sp++ = Value(true); break;
+            case OpCode::False: *sp++ = Value(false); break;
+            case OpCode::Int: *sp++ = Value((int)ReadU32(ip)); break;
+            case OpCode::Pop: *--sp = Value(); break;
+            case OpCode::Expression:
+                if (sp[-1].IsError())
+                    goto exit;
+                *--sp = Value();
+                break;
+
+            case OpCode::GetLocal: *sp++ = slots[ReadU16(ip)]; break;
+            case OpCode::SetLocal: slots[ReadU16(ip)] = sp[-1]; break;
+            case OpCode::DefineLocal:
+            {
+                Value value = std::move(*--sp);
+                if (value.IsError())
+                    goto exit;
+                slots[ReadU16(ip)] = std::move(value);
+                break;
+            }
+            case OpCode::GetEnv:
+            {
+                int depth = ReadU16(ip);
+                *sp++ = environment->GetAt(depth, ReadU16(ip));
+                break;
+            }
+            case OpCode::SetEnv:
+            {
+                int depth = ReadU16(ip);
+                environment->AssignAt(depth, ReadU16(ip), sp[-1]);
+                break;
+            }
+            case OpCode::DefineEnv:
+            {
+                Value value = std::move(*--sp);
+                if (value.IsError())
+                    goto exit;
+                environment->Define(ReadU16(ip), value);
+                break;
+            }
+            case OpCode::GetGlobal:
+            {
+                const Token* name = TOKEN();
+                *sp++ = globals->GetGlobal(name, (int)ReadU32(ip));
+                break;
+            }
+            case OpCode::SetGlobal:
+            {
+                const Token* name = TOKEN();
+                globals->AssignGlobal(name, (int)ReadU32(ip), sp[-1]);
+                break;
+            }
+            case OpCode::GetProperty:
+            {
+                const Token* name = TOKEN();
+                sp[-1] = GetProperty(sp[-1], name, function->propertyCaches[ReadU32(ip)]);
+                break;
+            }
+            case OpCode::SetProperty:
+            {
+                const Token* name = TOKEN();
+                Value value = std::move(*--sp);
+                sp[-1] = SetProperty(sp[-1], name, value, function->propertyCaches[ReadU32(ip)]);
+                break;
+            }
+            case OpCode::DefineGlobal:
+            {
+                const Token* name = TOKEN();
+                Value value = std::move(*--sp);
+                if (value.IsError() || !globals->DefineGlobal(name, value))
+                    goto exit;
+                break;
+            }
+
+            case OpCode::Add: BINARY_OP(ValueType::NUMBER, +)
+            case OpCode::Subtract: BINARY_OP(ValueType::NUMBER, -)
+            case OpCode::Multiply: BINARY_OP(ValueType::NUMBER, *)
+            case OpCode::Greater: BINARY_OP(ValueType::BOOL, >)
+            case OpCode::GreaterEqual: BINARY_OP(ValueType::BOOL, >=)
+            case OpCode::Less: BINARY_OP(ValueType::BOOL, <)
+            case OpCode::LessEqual: BINARY_OP(ValueType::BOOL, <=)
+            case OpCode::Binary:
+            {
+                Value result = Binary(TOKEN(), sp[-2], sp[-1]);
+                *--sp = Value();
+                sp[-1] = std::move(result);
+                break;
+            }
+            case OpCode::Equal:
+            {
+                bool equal = sp[-2].Equals(sp[-1]);
+                *--sp = Value();
+                sp[-1] = Value(equal);
+                break;
+            }
+            case OpCode::NotEqual:
+            {
+                bool equal = sp[-2].Equals(sp[-1]);
+                *--sp = Value();
+                sp[-1] = Value(!equal);
+                break;
+            }
+            case OpCode::Negate:
+            {
+                const Token* token = TOKEN();
+                if (sp[-1].type == ValueType::NUMBER)
+                    sp[-1].intValue = -sp[-1].intValue;
+                else
+                    sp[-1] = Unary(token, sp[-1]);
+                break;
+            }
+            case OpCode::Not:
+            {
+                bool truthy = sp[-1].IsTruthy();
+                sp[-1] = Value(!truthy);
+                break;
+            }
+
+            case OpCode::Jump: ip = code + ReadU32(ip); break;
+            case OpCode::JumpIfFalse:
+            {
+                uint32_t target = ReadU32(ip);
+                bool truthy = sp[-1].IsTruthy();
+                *--sp = Value();
+                if (!truthy)
+                    ip = code + target;
+                break;
+            }
+            case OpCode::And:
+            {
+                uint32_t target = ReadU32(ip);
+                if (!sp[-1].IsTruthy())
+                    ip = code + target;
+                else
+                    *--sp = Value();
+                break;
+            }
+            case OpCode::Or:
+            {
+                uint32_t target = ReadU32(ip);
+                if (sp[-1].IsTruthy() || sp[-1].IsError())
+                    ip = code + target;
+                else
+                    *--sp = Value();
+                break;
+            }
+
+            case OpCode::CheckCall:
+            {
+                int argCount = ReadU16(ip);
+                const Token* paren = TOKEN();
+                uint32_t target = ReadU32(ip);
+                const Value& callee = sp[-1];
+                if (callee.type == ValueType::FUNCTION && callee.GetFunction()->arity == argCount)
+                    break;
+                if (!CheckCall(callee, argCount, paren))
+                {
+                    sp[-1] = Value::Error;
+                    ip = code + target;
+                }
+                break;
+            }
+            case OpCode::TailCall:
+            {
+                const uint8_t* operand = ip;
+                int argCount = ReadU16(operand);
+                Value* callee = sp - argCount - 1;
+                if (callee->type == ValueType::FUNCTION && callee->GetFunction()->bytecode)
+                {
+                    // the callee and its arguments move down over this frame,
+                    // which is popped before the callee's is pushed
+                    Value* target = stack.data() + frame->base - 1;
+                    for (int i = 0; i <= argCount; ++i)
+                        target[i] = std::move(callee[i]);
+                    while (sp > target + argCount + 1)
+                        *--sp = Value();
+                    size_t base = frame->base;
+                    environment = std::move(frame->environment);
+                    frames.pop_back();
+                    Function* next = target->GetFunction();
+                    EnterBytecode(*next->bytecode, next->closure, base, argCount);
+                    LOAD_FRAME();
+                    sp = stack.data() + stackTop;
+                    break;
+                }
+                // natives and classes are called normally and the Return after
+                // the call returns their result
+            }
+            // fall through
+            case OpCode::Call:
+            {
+                int argCount = ReadU16(ip);
+                Value* callee = sp - argCount - 1;
+                frame->ip = ip;
+                if (callee->type == ValueType::FUNCTION && callee->GetFunction()->bytecode)
+                {
+                    Function* target = callee->GetFunction();
+                    EnterBytecode(*target->bytecode, target->closure, callee + 1 - stack.data(), argCount);
+                    LOAD_FRAME();
+                    sp = stack.data() + stackTop;
+                    break;
+                }
+
+                // natives and classes, which may call back into the VM
+                size_t calleeSlot = callee - stack.data();
+                Value callable = std::move(*callee);
+                std::vector<Value> args(std::make_move_iterator(callee + 1), std::make_move_iterator(sp));
+                stackTop = calleeSlot + 1;
+                Value result = Call(callable, args);
+                LOAD_FRAME();
+                sp = stack.data() + calleeSlot;
+                *sp++ = std::move(result);
+                break;
+            }
+
+            case OpCode::Closure:
+            {
+                const BytecodeFunction* declared = function->functions[ReadU32(ip)];
+                Function* closure = new Function(declared->name, nullptr, nullptr, declared->arity, environment);
+                closure->bytecode = declared;
+                *sp++ = Value(closure, ValueType::FUNCTION);
+                break;
+            }
+            case OpCode::Class:
+                *sp++ = Value(new LoxClass(TOKEN()->index), ValueType::CLASS);
+                break;
+            case OpCode::Print:
+            {
+                Value value = std::move(*--sp);
+                if (value.IsError())
+                    goto exit;
+                value.Print();
+                break;
+            }
+            case OpCode::PushEnv:
+                environment = new Environment(environment, ReadU16(ip));
+                break;
+            case OpCode::PopEnv:
+                environment = environment->Parent();
+                break;
+
+            case OpCode::Return:
+                returnValue = std::move(*--sp);
+                goto exit;
+            case OpCode::Exit:
+            exit:
+            {
+                Value result = returnValue;
+                Value* callee = stack.data() + frame->base - 1;
+                while (sp > callee)
+                    *--sp = Value();
+                environment = std::move(frame->environment);
+                frames.pop_back();
+                if (frames.size() == exitDepth)
+                {
+                    stackTop = callee - stack.data();
+                    return result;
+                }
+                LOAD_FRAME();
+                *sp++ = std::move(result);
+                break;
+            }
+        }
+    }
+
+#undef LOAD_FRAME
+#undef TOKEN
+#undef BINARY_OP
+}
@@ -2,34 +2,142 @@
 #include "scanner.h"
 #include "parser.h"
 #include "resolver.h"
+#include "flat_ast.h"
+#include "cache.h"
+#include "optimizer.h"
 #include "interpreter/interpreter.h"
+#include "interpreter/env.h"
+#include "interpreter/closure_compiler.h"
 
-void lox_run(const std::shared_ptr<Environment>& env, const char* source, int sourceLen)
+// Everything compiled from one source buffer. The AST is bump allocated from
+// the unit's arena and freed in one go with it. When running the flat engine
+// or a compiling engine the tree is only kept until it has been lowered or
+// compiled.
+struct CompileUnit
 {
     std::vector<Token> tokens;
-    scanner_scan(source, sourceLen, tokens);
-
+    Arena arena;
     StmtPtrList stmts;
-    if (!parser_parse(tokens, stmts))
+    FlatAst flat;
+    BytecodeProgram bytecode;
+    CompiledProgram compiled;
+};
+
+// Functions keep pointing at the tokens and AST they were declared in, and the
+// REPL calls them from later lines, so units are kept alive until exit.
+static std::vector<std::unique_ptr<CompileUnit>> g_units;
+
+// Counts reported errors so a program is only cached if it compiled cleanly
+static int g_errorCount = 0;
+
+static bool CompileTree(CompileUnit& unit)
+{
+    if (!parser_parse(unit.tokens, unit.arena, unit.stmts))
+        return false;
+    return resolver_resolve(unit.stmts);
+}
+
+// Runs after the tree is cached, so cached trees stay unoptimized and serve
+// runs with and without the optimizer alike
+static void Optimize(CompileUnit& unit, const LoxOptions& options)
+{
+    if (!options.optimize || options.engine == LoxEngine::Flat)
         return;
+    int before = options.optimizerStats ? optimizer_count_nodes(unit.stmts) : 0;
+    optimizer_optimize(unit.stmts, unit.arena);
+    if (options.optimizerStats)
+        fprintf(stderr, "optimizer: %d nodes before, %d after\n", before, optimizer_count_nodes(unit.stmts));
+}
 
-    if (!resolver_resolve(stmts))
+static bool CompileFlat(CompileUnit& unit)
+{
+    Arena arena;
+    std::vector<NodeIdx> program;
+    parser_parse_each(unit.tokens, arena, [&](StmtPtr stmt)
+    {
+        program.push_back(flatast_lower(unit.tokens, *stmt, unit.flat));
+        arena.Reset();
+    });
+    flatast_finish(unit.flat, program);
+    return resolver_resolve(unit.flat);
+}
+
+static bool Compile(CompileUnit& unit, const char* source, int sourceLen, const LoxOptions& options)
+{
+    std::string cachePath;
+    if (options.cacheDir)
+    {
+        cachePath = cache_path(options.cacheDir, source, sourceLen);
+        if (cache_load(cachePath, source, sourceLen, unit.tokens, unit.flat))
+        {
+            if (options.engine != LoxEngine::Flat)
+                flatast_raise(unit.flat, unit.arena, unit.stmts);
+            Optimize(unit, options);
+            return true;
+        }
+    }
+
+    int errorCount = g_errorCount;
+    scanner_scan(source, sourceLen, unit.tokens);
+    bool compiled = options.engine == LoxEngine::Flat ? CompileFlat(unit) : CompileTree(unit);
+    if (compiled && !cachePath.empty() && g_errorCount == errorCount)
+    {
+        if (options.engine != LoxEngine::Flat)
+            flatast_build(unit.tokens, unit.stmts, unit.flat);
+        cache_store(cachePath, source, sourceLen, unit.tokens, unit.flat);
+        if (options.engine != LoxEngine::Flat)
+            unit.flat = FlatAst();
+    }
+    if (compiled)
+        Optimize(unit, options);
+    return compiled;
+}
+
+void lox_run(const Ref<Environment>& env, const char* source, int sourceLen, const LoxOptions& options)
+{
+    g_units.emplace_back(new CompileUnit());
+    CompileUnit& unit = *g_units.back();
+    if (!Compile(unit, source, sourceLen, options))
         return;
 
     Interpreter interpreter(env);
-    interpreter.ExecuteBlock(stmts);
+    if (options.engine == LoxEngine::Flat)
+        interpreter.ExecuteFlat(unit.flat, unit.flat.program);
+    else if (options.engine == LoxEngine::Vm)
+    {
+        bytecode_compile(unit.stmts, unit.bytecode);
+        unit.stmts = StmtPtrList();
+        unit.arena.Reset();
+        interpreter.ExecuteBytecode(unit.bytecode);
+    }
+    else if (options.engine == LoxEngine::Closure)
+    {
+        closure_compile(unit.stmts, unit.compiled);
+        unit.stmts = StmtPtrList();
+        unit.arena.Reset();
+        unit.compiled.main(interpreter);
+    }
+    else
+        interpreter.ExecuteBlock(unit.stmts);
     printf("\n");
 }
 
+int lox_error_count()
+{
+    return g_errorCount;
+}
+
 void lox_error(int line, const char* message)
 {
+    ++g_errorCount;
     printf("[line %d] Error %s\n", line, message);
 }
 
 void lox_error(const Token& token, const char* message)
 {
+    ++g_errorCount;
     if (token.type == TokenType::END)
-        printf("[line %d] Error %s at end\n", token.line, message);
+        printf("[line %d] Error %s at end\n", token_line(token), message);
     else
-        printf("[line %d] Error %s at %s\n", token.line, message, token.lexeme);
+        printf("[line %d] Error %s at %.*s\n", token_line(token), message, token.length, token_text(token));
 }
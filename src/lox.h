@@ -1,9 +1,26 @@
 #pragma once
-#include <memory>
+#include "interpreter/gc.h"
 
 struct Token;
 class Environment;
 
-void lox_run(const std::shared_ptr<Environment>& env, const char* source, int sourceLen);
+enum class LoxEngine
+{
+    Tree,// walk the pointer AST
+    Flat,// lower to the flat AST and walk that instead
+    Vm,// compile the tree to bytecode and run it on the stack VM
+    Closure// build a tree of specialized C++ callables and call that
+};
+
+struct LoxOptions
+{
+    LoxEngine engine = LoxEngine::Tree;
+    const char* cacheDir = nullptr;// directory for compiled programs, see cache.h
+    bool optimize = true;// run the tree through optimizer.h, except for the flat engine
+    bool optimizerStats = false;// print node counts before and after optimizing
+};
+
+void lox_run(const Ref<Environment>& env, const char* source, int sourceLen, const LoxOptions& options = LoxOptions());
 void lox_error(const Token& token, const char* message);
 void lox_error(int line, const char* message);
+int lox_error_count();// errors reported since startup
@@ -1,36 +1,147 @@
 #include <stdio.h>
+#include <string.h>
 #include "lox.h"
 #include "interpreter/env.h"
+#include "symbols.h"
 #include <string>
-#include <sstream>
-#include <fstream>
+#include <deque>
 #include <time.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 static Value ClockFunc(Interpreter& interpreter, std::vector<Value>& args)
 {
 	return Value((int)time(nullptr));
 }
 
+// Loads a script without copying it. Regular files are memory mapped and the
+// scanner works directly on the mapped pages; anything that cannot be mapped
+// (pipes, character devices) is read once into a single growing buffer.
+// The returned memory is never released as tokens reference it until exit.
+static const char* LoadFile(const char* path, int& length)
+{
+#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat info;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+	{
+		length = (int)info.st_size;
+		if (length == 0)
+		{
+			close(fd);
+			return "";
+		}
+		void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED)
+		{
+			madvise(mapped, length, MADV_SEQUENTIAL);
+			close(fd);
+			return (const char*)mapped;
+		}
+	}
+
+	size_t capacity = 1 << 16, size = 0;
+	char* buffer = (char*)malloc(capacity);
+	ssize_t bytesRead;
+	while ((bytesRead = read(fd, buffer + size, capacity - size)) > 0)
+	{
+		size += bytesRead;
+		if (size == capacity)
+			buffer = (char*)realloc(buffer, capacity *= 2);
+	}
+	close(fd);
+	if (bytesRead < 0)
+	{
+		free(buffer);
+		return nullptr;
+	}
+	length = (int)size;
+	return buffer;
+#else
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return nullptr;
+	size_t capacity = 1 << 16, size = 0, bytesRead;
+	char* buffer = (char*)malloc(capacity);
+	while ((bytesRead = fread(buffer + size, 1, capacity - size, file)) > 0)
+	{
+		size += bytesRead;
+		if (size == capacity)
+			buffer = (char*)realloc(buffer, capacity *= 2);
+	}
+	fclose(file);
+	length = (int)size;
+	return buffer;
+#endif
+}
+
 int main(int argc, char** argv)
 {
-	std::shared_ptr<Environment> env = std::make_shared<Environment>();
-	env->DefineFunction("time", ClockFunc, 0);
+	LoxOptions options;
+	GcOptions gcOptions;
+	const char* path = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strncmp(argv[i], "--gc-block=", 11) == 0)
+			gcOptions.blockKB = atoi(argv[i] + 11);
+		else if (strncmp(argv[i], "--gc-young=", 11) == 0)
+			gcOptions.youngThreshold = atoi(argv[i] + 11);
+		else if (strncmp(argv[i], "--gc-old-growth=", 16) == 0)
+			gcOptions.oldGrowthPercent = atoi(argv[i] + 16);
+		else if (strcmp(argv[i], "--gc-stats") == 0)
+			gcOptions.stats = true;
+		else if (strcmp(argv[i], "--engine=tree") == 0)
+			options.engine = LoxEngine::Tree;
+		else if (strcmp(argv[i], "--engine=flat") == 0)
+			options.engine = LoxEngine::Flat;
+		else if (strcmp(argv[i], "--engine=vm") == 0)
+			options.engine = LoxEngine::Vm;
+		else if (strcmp(argv[i], "--engine=closure") == 0)
+			options.engine = LoxEngine::Closure;
+		else if (strcmp(argv[i], "--no-optimize") == 0)
+			options.optimize = false;
+		else if (strcmp(argv[i], "--optimizer-stats") == 0)
+			options.optimizerStats = true;
+		else if (strncmp(argv[i], "--cache-dir=", 12) == 0)
+			options.cacheDir = argv[i] + 12;
+		else if (strncmp(argv[i], "--", 2) == 0)
+		{
+			printf("Unknown option %s\n", argv[i]);
+			return 1;
+		}
+		else
+			path = argv[i];
+	}
+
+	gc_configure(gcOptions);
+	Ref<Environment> env = new Environment();
+	env->DefineFunction(symbol_intern("time", 4), ClockFunc, 0);
 
-	if (argc > 1)
+	if (path)
 	{
-		std::stringstream buf;
-		std::ifstream file(argv[1]);
-		if (!file)
+		int length = 0;
+		const char* contents = LoadFile(path, length);
+		if (!contents)
 		{
-			printf("Failed to open %s\n", argv[1]);
+			printf("Failed to open %s\n", path);
 			return 1;
 		}
-		buf << file.rdbuf();
-		const std::string& contents = buf.str();
-		lox_run(env, contents.c_str(), contents.size());
+		lox_run(env, contents, length, options);
+		if (gcOptions.stats)
+			gc_print_stats();
 	}
 	else
 	{
+		// tokens keep pointing into the source, so every line must stay alive
+		std::deque<std::string> lines;
 		char lineBuf[255];
 		while (true)
 		{
@@ -38,7 +149,8 @@ int main(int argc, char** argv)
 			const char* line = fgets(lineBuf, 255, stdin);
             if (!line) continue;
 			printf("%s\n", line);
-			lox_run(env, line, strlen(line));
+			lines.push_back(line);
+			lox_run(env, lines.back().c_str(), lines.back().size(), options);
 		}
 		return 0;
 	}
@@ -0,0 +1,347 @@
+#include "optimizer.h"
+#include "ast_visitors.h"
+#include "interpreter/value.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+static bool IsLiteral(const Expr* expr)
+{
+    return expr && expr->type == ExprType::Literal;
+}
+
+static const ExprLiteral& AsLiteral(const Expr* expr)
+{
+    return *static_cast<const ExprLiteral*>(expr);
+}
+
+// Value::IsTruthy for a literal, without interning string literals
+static bool IsTruthy(const ExprLiteral& literal)
+{
+    switch (literal.litType)
+    {
+        case LitType::Nil: return false;
+        case LitType::String: return true;
+        default: return literal.intValue > 0;
+    }
+}
+
+// Walks the tree in the same scopes as the resolver, so that each local read
+// or assignment can be matched with its declaration. Declarations that are not
+// a var (functions, classes, parameters) are tracked as nullptr so they still
+// shadow outer variables. Globals are never propagated: they can be read
+// before they are defined and assigned from later REPL lines.
+//
+// The tree is optimized twice. The first pass folds and records the locals
+// that are assigned anywhere, the second also propagates the others.
+struct Optimizer : public ExprVisitor<ExprPtr>, StmtVisitor<StmtPtr>
+{
+    Optimizer(Arena& arena)
+        : m_arena(arena)
+    {}
+
+    void Run(StmtPtrList& stmts)
+    {
+        OptimizeList(stmts);
+        m_propagate = true;
+        OptimizeList(stmts);
+    }
+
+    ExprPtr Optimize(ExprPtr expr) { return expr ? VisitExpr(*expr) : nullptr; }
+
+    // nullptr if the statement can be dropped
+    StmtPtr Optimize(StmtPtr stmt) { return VisitStmt(*stmt); }
+
+    // for statements that cannot be left out, such as a loop body
+    StmtPtr OptimizeBranch(StmtPtr stmt)
+    {
+        if (!stmt)
+            return nullptr;
+        StmtPtr optimized = Optimize(stmt);
+        return optimized ? optimized : m_arena.New<StmtBlock>(StmtPtrList());
+    }
+
+    // compacts the list in place
+    void OptimizeList(StmtPtrList& stmts)
+    {
+        int count = 0;
+        for (int i = 0; i < stmts.count; ++i)
+        {
+            // a missing statement makes the walkers fail, so it must stay
+            StmtPtr stmt = stmts[i] ? Optimize(stmts[i]) : nullptr;
+            if (stmts[i] && !stmt)
+                continue;
+            stmts[count++] = stmt;
+            if (stmt && stmt->type == StmtType::Return)
+                break;
+        }
+        stmts.count = count;
+    }
+
+    void BeginScope() { m_scopes.emplace_back(); }
+    void EndScope() { m_scopes.pop_back(); }
+
+    void Declare(const Token* name, const StmtVar* var)
+    {
+        if (!m_scopes.empty())
+            m_scopes.back()[name->index] = var;
+    }
+
+    // nullptr for globals and locals that are not a var
+    const StmtVar* Lookup(const Token* name) const
+    {
+        for (int i = (int)m_scopes.size() - 1; i >= 0; --i)
+        {
+            auto item = m_scopes[i].find(name->index);
+            if (item != m_scopes[i].end())
+                return item->second;
+        }
+        return nullptr;
+    }
+
+    ExprPtr NewInt(int value) { return m_arena.New<ExprLiteral>(value); }
+    ExprPtr NewBool(bool value) { return m_arena.New<ExprLiteral>(value); }
+
+    ExprPtr VisitAssign(ExprAssign& expr) override
+    {
+        expr.value = Optimize(expr.value);
+        if (const StmtVar* var = Lookup(expr.name))
+            m_assigned.insert(var);
+        return &expr;
+    }
+
+    // Only folds operands that cannot fail: errors must still be reported
+    // when, and if, the expression runs
+    ExprPtr VisitBinary(ExprBinary& expr) override
+    {
+        expr.left = Optimize(expr.left);
+        expr.right = Optimize(expr.right);
+        if (!IsLiteral(expr.left) || !IsLiteral(expr.right))
+            return &expr;
+
+        const ExprLiteral& left = AsLiteral(expr.left);
+        const ExprLiteral& right = AsLiteral(expr.right);
+        if (left.litType == LitType::String || right.litType == LitType::String)
+            return &expr;
+        switch (expr.op->type)
+        {
+            case TokenType::EQUAL_EQUAL: return NewBool(Value(left).Equals(Value(right)));
+            case TokenType::BANG_EQUAL: return NewBool(!Value(left).Equals(Value(right)));
+            default: break;
+        }
+        if (left.litType != LitType::Int || right.litType != LitType::Int)
+            return &expr;
+        switch (expr.op->type)
+        {
+            case TokenType::PLUS: return NewInt(left.intValue + right.intValue);
+            case TokenType::MINUS: return NewInt(left.intValue - right.intValue);
+            case TokenType::STAR: return NewInt(left.intValue * right.intValue);
+            case TokenType::GREATER: return NewBool(left.intValue > right.intValue);
+            case TokenType::GREATER_EQUAL: return NewBool(left.intValue >= right.intValue);
+            case TokenType::LESS: return NewBool(left.intValue < right.intValue);
+            case TokenType::LESS_EQUAL: return NewBool(left.intValue <= right.intValue);
+            default: return &expr;
+        }
+    }
+
+    ExprPtr VisitCall(ExprCall& expr) override
+    {
+        expr.callee = Optimize(expr.callee);
+        for (ExprPtr& arg : expr.args)
+            arg = Optimize(arg);
+        return &expr;
+    }
+
+    ExprPtr VisitGet(ExprGet& expr) override
+    {
+        expr.object = Optimize(expr.object);
+        return &expr;
+    }
+
+    ExprPtr VisitGrouping(ExprGrouping& expr) override
+    {
+        return Optimize(expr.expr);
+    }
+
+    ExprPtr VisitLiteral(ExprLiteral& expr) override
+    {
+        return &expr;
+    }
+
+    ExprPtr VisitLogical(ExprLogical& expr) override
+    {
+        expr.left = Optimize(expr.left);
+        expr.right = Optimize(expr.right);
+        if (!IsLiteral(expr.left))
+            return &expr;
+        bool truthy = IsTruthy(AsLiteral(expr.left));
+        bool keepLeft = expr.op->type == TokenType::OR ? truthy : !truthy;
+        return keepLeft ? expr.left : expr.right;
+    }
+
+    ExprPtr VisitSet(ExprSet& expr) override
+    {
+        expr.object = Optimize(expr.object);
+        expr.value = Optimize(expr.value);
+        return &expr;
+    }
+
+    ExprPtr VisitUnary(ExprUnary& expr) override
+    {
+        expr.right = Optimize(expr.right);
+        if (!IsLiteral(expr.right))
+            return &expr;
+        const ExprLiteral& right = AsLiteral(expr.right);
+        if (expr.op->type == TokenType::BANG)
+            return NewBool(!IsTruthy(right));
+        if (expr.op->type == TokenType::MINUS && right.litType == LitType::Int)
+            return NewInt(-right.intValue);
+        return &expr;
+    }
+
+    ExprPtr VisitVariable(ExprVariable& expr) override
+    {
+        const StmtVar* var = Lookup(expr.name);
+        if (m_propagate && var && IsLiteral(var->init) && m_assigned.count(var) == 0)
+            return var->init;
+        return &expr;
+    }
+
+    StmtPtr VisitBlock(StmtBlock& stmt) override
+    {
+        BeginScope();
+        OptimizeList(stmt.stmts);
+        EndScope();
+        return &stmt;
+    }
+
+    // an expression statement only matters for its side effects
+    StmtPtr VisitExpression(StmtExpression& stmt) override
+    {
+        stmt.expr = Optimize(stmt.expr);
+        return IsLiteral(stmt.expr) ? nullptr : &stmt;
+    }
+
+    StmtPtr VisitFunction(StmtFunction& stmt) override
+    {
+        Declare(stmt.name, nullptr);
+        BeginScope();
+        for (const Token* param : stmt.params)
+            Declare(param, nullptr);
+        OptimizeList(stmt.body);
+        EndScope();
+        return &stmt;
+    }
+
+    StmtPtr VisitIf(StmtIf& stmt) override
+    {
+        stmt.condition = Optimize(stmt.condition);
+        if (IsLiteral(stmt.condition))
+        {
+            if (IsTruthy(AsLiteral(stmt.condition)))
+                return Optimize(stmt.thenBranch);
+            return stmt.elseBranch ? Optimize(stmt.elseBranch) : nullptr;
+        }
+        stmt.thenBranch = OptimizeBranch(stmt.thenBranch);
+        if (stmt.elseBranch)
+            stmt.elseBranch = Optimize(stmt.elseBranch);
+        return &stmt;
+    }
+
+    StmtPtr VisitPrint(StmtPrint& stmt) override
+    {
+        stmt.expr = Optimize(stmt.expr);
+        return &stmt;
+    }
+
+    StmtPtr VisitReturn(StmtReturn& stmt) override
+    {
+        stmt.value = Optimize(stmt.value);
+        return &stmt;
+    }
+
+    StmtPtr VisitVar(StmtVar& stmt) override
+    {
+        stmt.init = Optimize(stmt.init);
+        Declare(stmt.name, &stmt);
+        return &stmt;
+    }
+
+    StmtPtr VisitWhile(StmtWhile& stmt) override
+    {
+        stmt.condition = Optimize(stmt.condition);
+        if (IsLiteral(stmt.condition) && !IsTruthy(AsLiteral(stmt.condition)))
+            return nullptr;
+        stmt.body = OptimizeBranch(stmt.body);
+        return &stmt;
+    }
+
+    StmtPtr VisitClass(StmtClass& stmt) override
+    {
+        Declare(stmt.name, nullptr);
+        return &stmt;
+    }
+
+    Arena& m_arena;
+    std::vector<std::unordered_map<int, const StmtVar*>> m_scopes;// symbol id to declaration
+    std::unordered_set<const StmtVar*> m_assigned;
+    bool m_propagate = false;
+};
+
+void optimizer_optimize(StmtPtrList& stmts, Arena& arena)
+{
+    Optimizer optimizer(arena);
+    optimizer.Run(stmts);
+}
+
+struct NodeCounter : public ConstExprVisitor<int>, ConstStmtVisitor<int>
+{
+    int Count(Expr* expr) { return expr ? VisitExpr(*expr) : 0; }
+    int Count(Stmt* stmt) { return stmt ? VisitStmt(*stmt) : 0; }
+    int Count(const StmtPtrList& stmts)
+    {
+        int count = 0;
+        for (Stmt* stmt : stmts)
+            count += Count(stmt);
+        return count;
+    }
+
+    int VisitAssign(const ExprAssign& expr) override { return 1 + Count(expr.value); }
+    int VisitBinary(const ExprBinary& expr) override { return 1 + Count(expr.left) + Count(expr.right); }
+    int VisitCall(const ExprCall& expr) override
+    {
+        int count = 1 + Count(expr.callee);
+        for (Expr* arg : expr.args)
+            count += Count(arg);
+        return count;
+    }
+    int VisitGet(const ExprGet& expr) override { return 1 + Count(expr.object); }
+    int VisitGrouping(const ExprGrouping& expr) override { return 1 + Count(expr.expr); }
+    int VisitLiteral(const ExprLiteral&) override { return 1; }
+    int VisitLogical(const ExprLogical& expr) override { return 1 + Count(expr.left) + Count(expr.right); }
+    int VisitSet(const ExprSet& expr) override { return 1 + Count(expr.object) + Count(expr.value); }
+    int VisitUnary(const ExprUnary& expr) override { return 1 + Count(expr.right); }
+    int VisitVariable(const ExprVariable&) override { return 1; }
+
+    int VisitBlock(const StmtBlock& stmt) override { return 1 + Count(stmt.stmts); }
+    int VisitExpression(const StmtExpression& stmt) override { return 1 + Count(stmt.expr); }
+    int VisitFunction(const StmtFunction& stmt) override { return 1 + Count(stmt.body); }
+    int VisitIf(const StmtIf& stmt) override { return 1 + Count(stmt.condition) + Count(stmt.thenBranch) + Count(stmt.elseBranch); }
+    int VisitPrint(const StmtPrint& stmt) override { return 1 + Count(stmt.expr); }
+    int VisitReturn(const StmtReturn& stmt) override { return 1 + Count(stmt.value); }
+    int VisitVar(const StmtVar& stmt) override { return 1 + Count(stmt.init); }
+    int VisitWhile(const StmtWhile& stmt) override { return 1 + Count(stmt.condition) + Count(stmt.body); }
+    int VisitClass(const StmtClass& stmt) override
+    {
+        int count = 1;
+        for (const StmtFunction* method : stmt.methods)
+            count += VisitFunction(*method);
+        return count;
+    }
+};
+
+int optimizer_count_nodes(const StmtPtrList& stmts)
+{
+    NodeCounter counter;
+    return counter.Count(stmts);
+}
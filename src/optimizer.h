@@ -0,0 +1,13 @@
+#pragma once
+#include "ast.h"
+
+// Rewrites resolved statements in place before they are run: folds operators
+// on literals, replaces reads of locals whose initialiser is a literal and
+// which are never assigned by that literal, drops if and while statements
+// whose condition is a literal that skips them, and drops statements after a
+// return. Behaviour, including runtime errors, is unchanged. New nodes are
+// allocated from arena.
+void optimizer_optimize(StmtPtrList& stmts, Arena& arena);
+
+// Expression and statement nodes reachable from stmts
+int optimizer_count_nodes(const StmtPtrList& stmts);
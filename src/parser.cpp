@@ -2,23 +2,38 @@
 #include "lox.h"
 #include "scanner.h"
 #include "ast.h"
-
-typedef std::unique_ptr<Stmt> StmtPtr;
-typedef std::unique_ptr<Expr> ExprPtr;
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <thread>
 
 struct Parser
 {
     const std::vector<Token>& m_tokens;
-    int m_current;
+    Arena& m_arena;
+    int m_current, m_end;
+    bool m_speculative;// errors are only recorded, see ParseParallel
+    bool m_hadError;
 
-    Parser(const std::vector<Token>& tokens)
+    Parser(const std::vector<Token>& tokens, Arena& arena)
         : m_tokens(tokens)
+        , m_arena(arena)
         , m_current(0)
+        , m_end((int)tokens.size() - 1)
+        , m_speculative(false)
+        , m_hadError(false)
     {}
 
     inline const Token& Peek() { return m_tokens[m_current]; }
     inline const Token& Previous() { return m_tokens[m_current - 1]; }
-    inline bool IsAtEnd() { return Peek().type == TokenType::END; }
+    inline bool IsAtEnd() { return m_current >= m_end; }
+
+    void Error(const Token& token, const char* message)
+    {
+        m_hadError = true;
+        if (!m_speculative)
+            lox_error(token, message);
+    }
 
     const Token& Advance()
     {
@@ -46,7 +61,7 @@ struct Parser
     {
         if (Check(type)) return &Advance();
 
-        lox_error(Peek(), message);
+        Error(Peek(), message);
         return nullptr;
     }
 
@@ -71,20 +86,20 @@ struct Parser
     }
 
     // program -> declaration* EOF
-    void Parse(std::vector<StmtPtr>& stmts)
+    void Parse(const std::function<void(StmtPtr)>& onStmt)
     {
         while (!IsAtEnd())
         {
             StmtPtr stmt(Declaration());
             if (stmt)
-                stmts.push_back(std::move(stmt));
+                onStmt(stmt);
         }
     }
 
     //declaration -> classDecl | funcDecl | varDecl | statement
     StmtPtr Declaration()
     {
-        StmtPtr stmt;
+        StmtPtr stmt = nullptr;
         if (Match(TokenType::CLASS)) stmt = Class();
         else if (Match(TokenType::FUN)) stmt = Function();
         else if (Match(TokenType::VAR)) stmt = VarDecl();
@@ -101,16 +116,16 @@ struct Parser
     {
         const Token* name = Consume(TokenType::IDENTIFIER, "Expected class name");
         if (!name)
-            return StmtPtr();
+            return nullptr;
         if (!Consume(TokenType::LEFT_BRACE, "Expect '{' before class body"))
-            return StmtPtr();
+            return nullptr;
 
-        StmtFunctionPtrList methods;
+        std::vector<StmtFunctionPtr> methods;
         while (!Check(TokenType::RIGHT_BRACE) && !IsAtEnd())
             methods.push_back(Function());
 
         Consume(TokenType::RIGHT_BRACE, "Expected '}' after class body");
-        return StmtPtr(new StmtClass(name, std::move(methods)));
+        return m_arena.New<StmtClass>(name, m_arena.NewList(methods));
     }
 
     // funcDecl -> "fun" function
@@ -119,9 +134,9 @@ struct Parser
     {
         const Token* name = Consume(TokenType::IDENTIFIER, "Expected function name");
         if (!name)
-            return StmtFunctionPtr();
+            return nullptr;
         if (!Consume(TokenType::LEFT_PAREN, "Expected '(' after function name"))
-            return StmtFunctionPtr();
+            return nullptr;
 
         std::vector<const Token*> params;
         if (!Check(TokenType::RIGHT_PAREN))
@@ -130,19 +145,19 @@ struct Parser
             {
                 const Token* param = Consume(TokenType::IDENTIFIER, "Expected parameter name");
                 if (!param)
-                    return StmtFunctionPtr();
+                    return nullptr;
                 params.push_back(param);
             }
             while (Match(TokenType::COMMA));
         }
         if (!Consume(TokenType::RIGHT_PAREN, "Expected ')' after parameters"))
-            return StmtFunctionPtr();
+            return nullptr;
         if (!Consume(TokenType::LEFT_BRACE, "Expected '{' before function body"))
-            return StmtFunctionPtr();
+            return nullptr;
         std::vector<StmtPtr> body;
         ParseBlock(body);
 
-        return StmtFunctionPtr(new StmtFunction(name, std::move(params), std::move(body)));
+        return m_arena.New<StmtFunction>(name, m_arena.NewList(params), m_arena.NewList(body));
     }
 
     // statement -> exprStmt | forStmt | ifStmt | printStmt | returnStmt | whileStmt | block
@@ -162,22 +177,22 @@ struct Parser
     StmtPtr ReturnStatement()
     {
         const Token* keyword = &Previous();
-        ExprPtr value;
+        ExprPtr value = nullptr;
         if (!Check(TokenType::SEMICOLON)) {
             value = Expression();
         }
         Consume(TokenType::SEMICOLON, "Expect ';' after return value");
 
-        return StmtPtr(new StmtReturn(keyword, std::move(value)));
+        return m_arena.New<StmtReturn>(keyword, value);
     }
 
     // forStmt -> "for" "(" (varDecl | exprStmt | ";") expression? ";" expression? ")" statement
     StmtPtr ForStatement()
     {
         if (!Consume(TokenType::LEFT_PAREN, "Expect '(' after 'for'"))
-            return StmtPtr();
+            return nullptr;
         
-        StmtPtr initialiser;
+        StmtPtr initialiser = nullptr;
         if (Match(TokenType::SEMICOLON))
         {}
         else if (Match(TokenType::VAR))
@@ -185,13 +200,13 @@ struct Parser
         else
             initialiser = ExpressionStatement();
 
-        ExprPtr condition;
+        ExprPtr condition = nullptr;
         if (!Check(TokenType::SEMICOLON))
             condition = Expression();
         if (!Consume(TokenType::SEMICOLON, "Expect ';' after loop condition"))
-            return StmtPtr();
+            return nullptr;
 
-        ExprPtr increment;
+        ExprPtr increment = nullptr;
         if (!Check(TokenType::RIGHT_PAREN))
             increment = Expression();
         Consume(TokenType::RIGHT_PAREN, "Expect ')' after for clause");
@@ -200,23 +215,23 @@ struct Parser
 
         if (increment)
         {
-            StmtPtrList block;
-            block.push_back(std::move(body));
-            block.push_back(StmtPtr(new StmtExpression(std::move(increment))));
-            body = StmtPtr(new StmtBlock(std::move(block)));
+            std::vector<StmtPtr> block;
+            block.push_back(body);
+            block.push_back(m_arena.New<StmtExpression>(increment));
+            body = m_arena.New<StmtBlock>(m_arena.NewList(block));
         }
 
         if (!condition)
-            condition = ExprPtr(new ExprLiteral(true));
+            condition = m_arena.New<ExprLiteral>(true);
 
-        body = StmtPtr(new StmtWhile(std::move(condition), std::move(body)));
+        body = m_arena.New<StmtWhile>(condition, body);
 
         if (initialiser)
         {
-            StmtPtrList block;
-            block.push_back(std::move(initialiser));
-            block.push_back(std::move(body));
-            body = StmtPtr(new StmtBlock(std::move(block)));
+            std::vector<StmtPtr> block;
+            block.push_back(initialiser);
+            block.push_back(body);
+            body = m_arena.New<StmtBlock>(m_arena.NewList(block));
         }
         
         return body;
@@ -235,37 +250,37 @@ struct Parser
     {
         std::vector<StmtPtr> stmts;
         ParseBlock(stmts);
-        return StmtPtr(new StmtBlock(std::move(stmts)));
+        return m_arena.New<StmtBlock>(m_arena.NewList(stmts));
     }
 
     // whileStmt -> "while" "(" expression ")" statement ;
     StmtPtr WhileStatement()
     {
         if (!Consume(TokenType::LEFT_PAREN, "Expect '(' after while"))
-            return StmtPtr();
+            return nullptr;
         ExprPtr condition = Expression();
         if (!Consume(TokenType::RIGHT_PAREN, "Expect ')' after while condition"))
-            return StmtPtr();
+            return nullptr;
         StmtPtr body = Statement();
 
-        return StmtPtr(new StmtWhile(std::move(condition), std::move(body)));
+        return m_arena.New<StmtWhile>(condition, body);
     }
 
     // ifStmt    -> "if" "(" expression ")" statement ( "else" statement )? ;
     StmtPtr IfStatement()
     {
         if (!Consume(TokenType::LEFT_PAREN, "Expect '(' after if"))
-            return StmtPtr();
+            return nullptr;
         ExprPtr condition = Expression();
         if (!Consume(TokenType::RIGHT_PAREN, "Expect ')' after if condition"))
-            return StmtPtr();
+            return nullptr;
         
         StmtPtr thenBranch = Statement();
-        StmtPtr elseBranch;
+        StmtPtr elseBranch = nullptr;
         if (Match(TokenType::ELSE))
             elseBranch = Statement();
 
-        return StmtPtr(new StmtIf(std::move(condition), std::move(thenBranch), std::move(elseBranch)));
+        return m_arena.New<StmtIf>(condition, thenBranch, elseBranch);
     }
 
     // printStmt -> "print" expression ";"
@@ -273,11 +288,11 @@ struct Parser
     {
         ExprPtr expr = Expression();
         if (!expr)
-            return StmtPtr();
+            return nullptr;
         if (!Consume(TokenType::SEMICOLON, "Expect ';' after expression"))
-            return StmtPtr();
+            return nullptr;
         
-        return StmtPtr(new StmtPrint(std::move(expr)));
+        return m_arena.New<StmtPrint>(expr);
     }
 
     // varDecl -> "var" IDENTIFIER ( "=" expression )? ";"
@@ -285,16 +300,16 @@ struct Parser
     {
         const Token* name = Consume(TokenType::IDENTIFIER, "Expected variable name");
         if (name == nullptr)
-            return StmtPtr();
+            return nullptr;
 
-        ExprPtr initialiser;
+        ExprPtr initialiser = nullptr;
         if (Match(TokenType::EQUAL))
             initialiser = Expression();
 
         if (!Consume(TokenType::SEMICOLON, "Expect ';' after variable declaration"))
-            return StmtPtr();
+            return nullptr;
 
-        return StmtPtr(new StmtVar(name, std::move(initialiser)));
+        return m_arena.New<StmtVar>(name, initialiser);
     }
 
     // exprStmt -> expression ";"
@@ -302,10 +317,10 @@ struct Parser
     {
         ExprPtr expr = Expression();
         if (!expr)
-            return StmtPtr();
+            return nullptr;
         if (!Consume(TokenType::SEMICOLON, "Expect ';' after expression"))
-            return StmtPtr();
-        return StmtPtr(new StmtExpression(std::move(expr)));
+            return nullptr;
+        return m_arena.New<StmtExpression>(expr);
     }
 
     // expression -> assignment
@@ -314,29 +329,34 @@ struct Parser
         return Assignment();
     }
 
-    // assignment -> identifier "=" assignment
+    // assignment -> ( call "." )? identifier "=" assignment
     //             | logic_or
     ExprPtr Assignment()
     {
         ExprPtr expr = LogicOr();
         if (!expr)
-            return ExprPtr();
+            return nullptr;
         
         if (Match(TokenType::EQUAL))
         {
             const Token& equals = Previous();
             ExprPtr value = Assignment();
             if (!value)
-                return ExprPtr();
+                return nullptr;
 
             if (expr->type == ExprType::Variable)
             {
-                const Token* name = static_cast<const ExprVariable*>(expr.get())->name;
-                return ExprPtr(new ExprAssign(name, std::move(value)));
+                const Token* name = static_cast<const ExprVariable*>(expr)->name;
+                return m_arena.New<ExprAssign>(name, value);
+            }
+            if (expr->type == ExprType::Get)
+            {
+                const ExprGet* get = static_cast<const ExprGet*>(expr);
+                return m_arena.New<ExprSet>(get->object, get->name, value);
             }
 
-            lox_error(equals, "Invalid assignment target");
-            return ExprPtr();
+            Error(equals, "Invalid assignment target");
+            return nullptr;
         }
         return expr;
     }
@@ -346,15 +366,15 @@ struct Parser
     {
         ExprPtr expr = LogicAnd();
         if (!expr)
-            return ExprPtr();
+            return nullptr;
 
         while (Match(TokenType::OR))
         {
             const Token& op = Previous();
             ExprPtr right = LogicOr();
             if (!right)
-                return ExprPtr();
-            expr = ExprPtr(new ExprLogical(std::move(expr), &op, std::move(right)));
+                return nullptr;
+            expr = m_arena.New<ExprLogical>(expr, &op, right);
         }
 
         return expr;
@@ -365,15 +385,15 @@ struct Parser
     {
         ExprPtr expr = Equality();
         if (!expr)
-            return ExprPtr();
+            return nullptr;
 
         while (Match(TokenType::AND))
         {
             const Token& op = Previous();
             ExprPtr right = Equality();
             if (!right)
-                return ExprPtr();
-            expr = ExprPtr(new ExprLogical(std::move(expr), &op, std::move(right)));
+                return nullptr;
+            expr = m_arena.New<ExprLogical>(expr, &op, right);
         }
 
         return expr;
@@ -384,15 +404,15 @@ struct Parser
     {
         ExprPtr expr = Comparison();
         if (!expr)
-            return ExprPtr();
+            return nullptr;
 
         while (Match(TokenType::BANG_EQUAL) || Match(TokenType::EQUAL_EQUAL))
         {
             const Token& op = Previous();
             ExprPtr right = Comparison();
             if (!right)
-                return ExprPtr();
-            expr = ExprPtr(new ExprBinary(std::move(expr), &op, std::move(right)));
+                return nullptr;
+            expr = m_arena.New<ExprBinary>(expr, &op, right);
         }
 
         return expr;
@@ -403,15 +423,15 @@ struct Parser
     {
         ExprPtr expr = Addition();
         if (!expr)
-            return ExprPtr();
+            return nullptr;
 
         while (Match(TokenType::GREATER) || Match(TokenType::GREATER_EQUAL) || Match(TokenType::LESS) || Match(TokenType::LESS_EQUAL))
         {
             const Token& op = Previous();
             ExprPtr right = Addition();
             if (!right)
-                return ExprPtr();
-            expr = ExprPtr(new ExprBinary(std::move(expr), &op, std::move(right)));
+                return nullptr;
+            expr = m_arena.New<ExprBinary>(expr, &op, right);
         }
 
         return expr;
@@ -422,15 +442,15 @@ struct Parser
     {
         ExprPtr expr = Multiplication();
         if (!expr)
-            return ExprPtr();
+            return nullptr;
 
         while (Match(TokenType::MINUS) || Match(TokenType::PLUS))
         {
             const Token& op = Previous();
             ExprPtr right = Multiplication();
             if (!right)
-                return ExprPtr();
-            expr = ExprPtr(new ExprBinary(std::move(expr), &op, std::move(right)));
+                return nullptr;
+            expr = m_arena.New<ExprBinary>(expr, &op, right);
         }
 
         return expr;
@@ -441,15 +461,15 @@ struct Parser
     {
         ExprPtr expr = Unary();
         if (!expr)
-            return ExprPtr();
+            return nullptr;
 
         while (Match(TokenType::SLASH) || Match(TokenType::STAR))
         {
             const Token& op = Previous();
             ExprPtr right = Unary();
             if (!right)
-                return ExprPtr();
-            expr = ExprPtr(new ExprBinary(std::move(expr), &op, std::move(right)));
+                return nullptr;
+            expr = m_arena.New<ExprBinary>(expr, &op, right);
         }
 
         return expr;
@@ -464,14 +484,14 @@ struct Parser
             const Token& op = Previous();
             ExprPtr right = Unary();
             if (!right)
-                return ExprPtr();
-            return ExprPtr(new ExprUnary(&op, std::move(right)));
+                return nullptr;
+            return m_arena.New<ExprUnary>(&op, right);
         }
 
         return Call();
     }
 
-    ExprPtr FinishCall(ExprPtr& callee)
+    ExprPtr FinishCall(ExprPtr callee)
     {
         std::vector<ExprPtr> args;
         if (!Check(TokenType::RIGHT_PAREN))
@@ -485,18 +505,25 @@ struct Parser
 
         const Token* token = Consume(TokenType::RIGHT_PAREN, "Expect ')' after arguments");
         if (!token)
-            return ExprPtr();
-        return ExprPtr(new ExprCall(std::move(callee), token, std::move(args)));
+            return nullptr;
+        return m_arena.New<ExprCall>(callee, token, m_arena.NewList(args));
     }
 
-    //call -> primary ( "(" arguments? ")" )*
+    //call -> primary ( "(" arguments? ")" | "." IDENTIFIER )*
     ExprPtr Call()
     {
         ExprPtr expr = Primary();
-        while (true)
+        while (expr)
         {
             if (Match(TokenType::LEFT_PAREN))
                 expr = FinishCall(expr);
+            else if (Match(TokenType::DOT))
+            {
+                const Token* name = Consume(TokenType::IDENTIFIER, "Expect property name after '.'");
+                if (!name)
+                    return nullptr;
+                expr = m_arena.New<ExprGet>(expr, name);
+            }
             else
                 break;
         }
@@ -508,40 +535,135 @@ struct Parser
     //               | IDENTIFIER
     ExprPtr Primary()
     {
-        if (Match(TokenType::FALSE)) return ExprPtr(new ExprLiteral(false));
-        if (Match(TokenType::TRUE)) return ExprPtr(new ExprLiteral(true));
-        if (Match(TokenType::NIL)) return ExprPtr(new ExprLiteral());
+        if (Match(TokenType::FALSE)) return m_arena.New<ExprLiteral>(false);
+        if (Match(TokenType::TRUE)) return m_arena.New<ExprLiteral>(true);
+        if (Match(TokenType::NIL)) return m_arena.New<ExprLiteral>();
 
         if (Match(TokenType::NUMBER))
-            return ExprPtr(new ExprLiteral(Previous().numberLiteral));
+            return m_arena.New<ExprLiteral>(Previous().index);
         if (Match(TokenType::STRING))
-            return ExprPtr(new ExprLiteral(Previous().stringLiteral));
+            return m_arena.New<ExprLiteral>(token_text(Previous()) + 1, Previous().length - 2, Previous().start + 1);
 
         if (Match(TokenType::LEFT_PAREN))
         {
             ExprPtr expr = Expression();
             if (!expr)
-                return ExprPtr();
+                return nullptr;
             if (!Consume(TokenType::RIGHT_PAREN, "Expect ')' after expression"))
-                return ExprPtr();
-            return ExprPtr(new ExprGrouping(std::move(expr)));
+                return nullptr;
+            return m_arena.New<ExprGrouping>(expr);
         }
 
         if (Match(TokenType::IDENTIFIER))
-            return ExprPtr(new ExprVariable(&Previous()));
+            return m_arena.New<ExprVariable>(&Previous());
 
-        lox_error(Peek(), "Expect expression");
-        return ExprPtr();
+        Error(Peek(), "Expect expression");
+        return nullptr;
     }
 };
 
-bool parser_parse(const std::vector<Token>& tokens, std::vector<StmtPtr>& stmts)
+// Token streams shorter than this are not worth handing to worker threads
+static const int ParallelParseMinTokens = 1 << 18;
+static const int ChunksPerThread = 4;
+
+struct ParseChunk
 {
-    Parser parser(tokens);
-    parser.Parse(stmts);
+    int begin, end;
+    Arena arena;
+    std::vector<StmtPtr> stmts;
+    bool hadError;
+
+    void Parse(const std::vector<Token>& tokens)
+    {
+        Parser parser(tokens, arena);
+        parser.m_current = begin;
+        parser.m_end = end;
+        parser.m_speculative = true;
+        parser.Parse([this](StmtPtr stmt) { stmts.push_back(stmt); });
+        hadError = parser.m_hadError;
+    }
+};
+
+// Splits the tokens into runs of whole declarations and parses the runs on
+// worker threads. A run may only start at a fun, class or var token outside
+// any brackets, which always begins a new top level declaration in a valid
+// program. Errors near a boundary would be recovered from differently than
+// by a serial parse, so if any run has an error the result is dropped and
+// the caller parses serially instead, reporting errors in the usual order.
+static bool ParseParallel(const std::vector<Token>& tokens, Arena& arena, int threadCount, std::vector<StmtPtr>& stmts)
+{
+    int tokenCount = (int)tokens.size() - 1;
+    int chunkCount = threadCount * ChunksPerThread;
+    int chunkSize = (tokenCount + chunkCount - 1) / chunkCount;
+    std::vector<std::unique_ptr<ParseChunk>> chunks;
+    chunks.emplace_back(new ParseChunk());
+    chunks.back()->begin = 0;
+    int depth = 0;
+    for (int i = 0; i < tokenCount; ++i)
+    {
+        switch (tokens[i].type)
+        {
+            case TokenType::LEFT_PAREN: case TokenType::LEFT_BRACE: ++depth; break;
+            case TokenType::RIGHT_PAREN: case TokenType::RIGHT_BRACE: --depth; break;
+            case TokenType::FUN: case TokenType::CLASS: case TokenType::VAR:
+                if (depth == 0 && i - chunks.back()->begin >= chunkSize)
+                {
+                    chunks.back()->end = i;
+                    chunks.emplace_back(new ParseChunk());
+                    chunks.back()->begin = i;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    chunks.back()->end = tokenCount;
+
+    std::atomic<int> nextChunk(0);
+    auto worker = [&]()
+    {
+        for (int i = nextChunk++; i < (int)chunks.size(); i = nextChunk++)
+            chunks[i]->Parse(tokens);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount && i < (int)chunks.size(); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (const std::unique_ptr<ParseChunk>& chunk : chunks)
+        if (chunk->hadError)
+            return false;
+    for (const std::unique_ptr<ParseChunk>& chunk : chunks)
+    {
+        stmts.insert(stmts.end(), chunk->stmts.begin(), chunk->stmts.end());
+        arena.Adopt(chunk->arena);
+    }
+    return true;
+}
+
+bool parser_parse(const std::vector<Token>& tokens, Arena& arena, StmtPtrList& stmts, int threadCount)
+{
+    if (threadCount <= 0)
+        threadCount = tokens.size() >= ParallelParseMinTokens ? (int)std::thread::hardware_concurrency() : 1;
+
+    std::vector<StmtPtr> parsed;
+    if (threadCount <= 1 || !ParseParallel(tokens, arena, threadCount, parsed))
+    {
+        Parser parser(tokens, arena);
+        parser.Parse([&parsed](StmtPtr stmt) { parsed.push_back(stmt); });
+    }
+    stmts = arena.NewList(parsed);
 
     for (const StmtPtr& stmt : stmts)
         if (!stmt)
             return false;
     return true;
 }
+
+void parser_parse_each(const std::vector<Token>& tokens, Arena& arena, const std::function<void(StmtPtr)>& onStmt)
+{
+    Parser parser(tokens, arena);
+    parser.Parse(onStmt);
+}
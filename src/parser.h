@@ -1,8 +1,16 @@
 #pragma once
 #include <vector>
-#include <memory>
+#include <functional>
 #include "ast.h"
 
 struct Token;
 
-bool parser_parse(const std::vector<Token>& tokens, StmtPtrList& stmts);
+// AST nodes are allocated from arena, which must outlive stmts.
+// threadCount of 0 picks automatically: long token streams are split between
+// top level declarations and parsed on worker threads, producing the same
+// statements and errors as a serial parse.
+bool parser_parse(const std::vector<Token>& tokens, Arena& arena, StmtPtrList& stmts, int threadCount = 0);
+
+// Hands each top level statement to onStmt as soon as it is parsed. Nothing
+// in arena is referenced by the parser between calls, so onStmt may Reset it.
+void parser_parse_each(const std::vector<Token>& tokens, Arena& arena, const std::function<void(StmtPtr)>& onStmt);
@@ -1,68 +1,318 @@
 #include "resolver.h"
 #include "lox.h"
+#include "symbols.h"
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cstdio>
 #include "ast_visitors.h"
+#include "flat_ast.h"
 
-struct VariableScope
+// Where a declaration or reference keeps the (depth, idx) pair the resolver
+// fills in once the storage of its variable is known
+struct VariableRef
 {
-	int variableIdx;
+	int* depth;
+	int* idx;
+	int scope;// scope the reference appears in
+};
+
+// A call whose callee is a variable, checked against the variable's function
+// when its scope closes
+struct CallRef
+{
+	int* arityChecked;
+	int argCount;
+	const Token* paren;
+};
+
+struct Variable
+{
+	VariableRef decl;
+	std::vector<VariableRef> refs;
+	int stackSlot;
+	int paramIdx;// -1 if not a parameter
+	bool captured;// referenced from a function nested in the declaring one
 	bool isDefined;
+	int arity;// parameters of the function declaring it, -1 for other declarations
+	bool assigned;
+	std::vector<CallRef> calls;
+};
+
+typedef std::unordered_map<int,int> ScopeMap;// symbol id to index in Scope::variables
+
+struct Scope
+{
+	ScopeMap names;
+	std::vector<Variable> variables;
+	int id;// index into ScopeResolver::scopeInfo
+	int frameTop;// first free stack slot when the scope was entered
+};
+
+// Kept for every scope until resolving finishes, so references from scopes
+// that have already closed can be patched when their variable's scope closes
+struct ScopeInfo
+{
+	int parent;
+	int functionLevel;
+	bool hasEnvironment;
 };
 
-typedef std::unordered_map<std::string,VariableScope> ScopeMap;
+struct Frame
+{
+	int top, size;
+};
 
 enum class FunctionType
 {
 	None, Function
 };
 
-struct Resolver : public ExprVisitor<void>, StmtVisitor<void>
+// Scope bookkeeping shared by the tree and flat AST resolvers.
+//
+// Locals are escape analysed: a variable only referenced from its own function
+// gets a slot in that function's frame on the interpreter's value stack
+// (depth StackVariable). A variable referenced from a nested function is
+// captured, and lives in a heap Environment created for its scope, which the
+// closure keeps alive. Scopes without captured variables create no
+// Environment, and the depth of a captured reference counts only the scopes
+// between it and its variable that do. Whether a variable is captured is only
+// known once its scope closes, so declarations and references are recorded
+// and patched then.
+struct ScopeResolver
 {
-	ScopeMap& PeekScope() {	return scopes[scopes.size() - 1]; }
+	Scope& PeekScope() { return scopes.back(); }
 	bool HasScope() { return scopes.size() > 0; }
 
-	void Declare(const Token& name)
+	void BeginScope()
 	{
-		ScopeMap& scope = HasScope() ? PeekScope() : globalScope;
-		auto item = scope.find(name.lexeme);
-		if (item == scope.end())
-			scope.emplace(name.lexeme, VariableScope{ (int)scope.size(), false });
-		else
+		scopes.emplace_back();
+		Scope& scope = PeekScope();
+		scope.id = (int)scopeInfo.size();
+		scope.frameTop = frames.back().top;
+		int parent = scopes.size() > 1 ? scopes[scopes.size() - 2].id : -1;
+		scopeInfo.push_back(ScopeInfo{ parent, (int)frames.size() - 1, false });
+	}
+
+	void EndScope(int& envSlots, int& frameSize)
+	{
+		Scope& scope = PeekScope();
+		bool captured = false;
+		int paramCount = 0;
+		for (const Variable& variable : scope.variables)
+		{
+			captured |= variable.captured;
+			if (variable.paramIdx >= 0)
+				++paramCount;
+		}
+		// a function's environment keeps its parameters in the first slots
+		envSlots = captured ? paramCount : 0;
+		scopeInfo[scope.id].hasEnvironment = captured;
+
+		for (Variable& variable : scope.variables)
+		{
+			CheckCalls(variable);
+			int idx = variable.stackSlot;
+			if (variable.captured)
+				idx = variable.paramIdx >= 0 ? variable.paramIdx : envSlots++;
+			Patch(variable.decl, variable, idx, scope.id);
+			for (const VariableRef& ref : variable.refs)
+				Patch(ref, variable, idx, scope.id);
+		}
+		frames.back().top = scope.frameTop;
+		frameSize = frames.back().size;
+		scopes.pop_back();
+	}
+
+	void BeginFunction()
+	{
+		frames.push_back(Frame{ 0, 0 });
+		BeginScope();
+	}
+
+	void EndFunction(int& envSlots, int& frameSize)
+	{
+		EndScope(envSlots, frameSize);
+		frames.pop_back();
+	}
+
+	void Declare(const Token& name, int& depth, int& idx)
+	{
+		depth = GlobalVariable;
+		idx = 0;
+		Declare(name, &depth, &idx, -1);
+	}
+
+	// parameters have no declaration to patch, only references
+	void DeclareParam(const Token& name, int paramIdx)
+	{
+		Declare(name, nullptr, nullptr, paramIdx);
+	}
+
+	void Declare(const Token& name, int* depth, int* idx, int paramIdx)
+	{
+		if (!HasScope())
+		{
+			if (!globalScope.insert(name.index).second)
+			{
+				lox_error(name, "Variable with this name already declared in this scope");
+				hadError = true;
+			}
+			return;
+		}
+
+		Scope& scope = PeekScope();
+		auto item = scope.names.emplace(name.index, (int)scope.variables.size());
+		if (!item.second)
 		{
 			lox_error(name, "Variable with this name already declared in this scope");
 			hadError = true;
+			return;
 		}
+		Frame& frame = frames.back();
+		scope.variables.push_back(Variable{ VariableRef{ depth, idx, scope.id }, {}, frame.top++, paramIdx, false, false, -1, false, {} });
+		frame.size = std::max(frame.size, frame.top);
 	}
 
 	void Define(const Token& name)
 	{
-		ScopeMap& scope = HasScope() ? PeekScope() : globalScope;
-		auto item = scope.find(name.lexeme);
-		if (item == scope.end())
+		if (!HasScope())
+			return;
+		Scope& scope = PeekScope();
+		auto item = scope.names.find(name.index);
+		if (item == scope.names.end())
 		{
 			lox_error(name, "Variable not declared");
 			hadError = true;
 		}
 		else
-			item->second.isDefined = true;
+			scope.variables[item->second].isDefined = true;
+	}
+
+	// Local functions are never redefined, so if nothing assigns to the name
+	// every call through it is known to reach the function
+	void DeclareFunction(const Token& name, int arity)
+	{
+		if (!HasScope())
+			return;
+		Scope& scope = PeekScope();
+		auto item = scope.names.find(name.index);
+		if (item != scope.names.end())
+			scope.variables[item->second].arity = arity;
+	}
+
+	void CheckCalls(const Variable& variable)
+	{
+		if (variable.arity < 0 || variable.assigned)
+			return;
+		for (const CallRef& call : variable.calls)
+		{
+			if (call.argCount == variable.arity)
+			{
+				*call.arityChecked = 1;
+				continue;
+			}
+			char buf[64];
+			std::snprintf(buf, 64, "Expected %d args but got %d", variable.arity, call.argCount);
+			lox_error(*call.paren, buf);
+			hadError = true;
+		}
+	}
+
+	// returns the local the name refers to, nullptr for globals
+	Variable* ResolveVariable(const Token* name, int& outDepth, int& outIdx)
+	{
+		for (int i = (int)scopes.size() - 1; i >= 0; --i)
+		{
+			auto item = scopes[i].names.find(name->index);
+			if (item != scopes[i].names.end())
+			{
+				Variable& variable = scopes[i].variables[item->second];
+				if (scopeInfo[scopes[i].id].functionLevel != (int)frames.size() - 1)
+					variable.captured = true;
+				variable.refs.push_back(VariableRef{ &outDepth, &outIdx, PeekScope().id });
+				return &variable;
+			}
+		}
+		// globals may be defined later, so they are bound by slot, not checked
+		outDepth = GlobalVariable;
+		outIdx = symbol_global_slot(name->index);
+		return nullptr;
+	}
+
+	void ResolveAssign(const Token* name, int& outDepth, int& outIdx)
+	{
+		if (Variable* variable = ResolveVariable(name, outDepth, outIdx))
+			variable->assigned = true;
+	}
+
+	// a callee that is a variable is resolved here to record the call
+	void ResolveCallee(const Token* name, int& outDepth, int& outIdx, int& arityChecked, int argCount, const Token* paren)
+	{
+		CheckInitialiser(*name);
+		if (Variable* variable = ResolveVariable(name, outDepth, outIdx))
+			variable->calls.push_back(CallRef{ &arityChecked, argCount, paren });
 	}
 
-	void ResolveVariable(const Token* name, int& outDepth, int& outIdx)
+	void CheckInitialiser(const Token& name)
 	{
-		for (int i = scopes.size() - 1; i >= 0; --i)
+		if (HasScope())
 		{
-			auto item = scopes[i].find(name->lexeme);
-			if (item != scopes[i].end())
+			Scope& scope = PeekScope();
+			auto item = scope.names.find(name.index);
+			if (item != scope.names.end() && scope.variables[item->second].isDefined == false)
 			{
-				outDepth = (int)scopes.size() - 1 - i;
-				outIdx = item->second.variableIdx;
-				return;
+				lox_error(name, "Cannot read local variable its own initialiser");
+				hadError = true;
 			}
 		}
 	}
 
+	void CheckReturn(const Token& keyword)
+	{
+		if (currentFunction == FunctionType::None)
+		{
+			lox_error(keyword, "Cannot return at top level");
+			hadError = true;
+		}
+	}
+
+	// A call returned straight from a function can reuse the function's frame,
+	// see Function::Call
+	bool IsTailCall(bool returnsCall) const
+	{
+		return returnsCall && currentFunction == FunctionType::Function;
+	}
+
+	void Patch(const VariableRef& ref, const Variable& variable, int idx, int scope)
+	{
+		if (!ref.idx)
+			return;
+		*ref.idx = idx;
+		if (!variable.captured)
+		{
+			*ref.depth = StackVariable;
+			return;
+		}
+		int depth = 0;
+		for (int s = ref.scope; s != scope; s = scopeInfo[s].parent)
+			if (scopeInfo[s].hasEnvironment)
+				++depth;
+		*ref.depth = depth;
+	}
+
+	std::vector<Scope> scopes;
+	std::vector<ScopeInfo> scopeInfo;
+	std::vector<Frame> frames = std::vector<Frame>(1, Frame{ 0, 0 });// frames[0] is for top level code
+	std::unordered_set<int> globalScope;
+	FunctionType currentFunction = FunctionType::None;
+	bool hadError = false;
+};
+
+struct Resolver : public ScopeResolver, ExprVisitor<void>, StmtVisitor<void>
+{
     void VisitBinary(ExprBinary& expr) override
     {
     	VisitExpr(*expr.left);
@@ -71,11 +321,28 @@ struct Resolver : public ExprVisitor<void>, StmtVisitor<void>
 
     void VisitCall(ExprCall& expr) override
     {
-    	VisitExpr(*expr.callee);
+    	if (expr.callee->type == ExprType::Variable)
+    	{
+    		ExprVariable& callee = static_cast<ExprVariable&>(*expr.callee);
+    		ResolveCallee(callee.name, callee.depth, callee.idx, expr.arityChecked, (int)expr.args.size(), expr.paren);
+    	}
+    	else
+    		VisitExpr(*expr.callee);
     	for (const ExprPtr& arg : expr.args)
     		VisitExpr(*arg);
     }
 
+    void VisitGet(ExprGet& expr) override
+    {
+    	VisitExpr(*expr.object);
+    }
+
+    void VisitSet(ExprSet& expr) override
+    {
+    	VisitExpr(*expr.object);
+    	VisitExpr(*expr.value);
+    }
+
     void VisitGrouping(ExprGrouping& group) override
     {
     	VisitExpr(*group.expr);
@@ -98,24 +365,14 @@ struct Resolver : public ExprVisitor<void>, StmtVisitor<void>
 
     void VisitVariable(ExprVariable& expr) override
     {
-    	if (HasScope())
-    	{
-    		ScopeMap& scope = PeekScope();
-    		auto item = scope.find(expr.name->lexeme);
-    		if (item != scope.end() && item->second.isDefined == false)
-    		{
-    			lox_error(*expr.name, "Cannot read local variable its own initialiser");
-    			hadError = true;
-    		}
-    	}
-
+    	CheckInitialiser(*expr.name);
     	ResolveVariable(expr.name, expr.depth, expr.idx);
     }
 
     void VisitAssign(ExprAssign& expr) override
     {
     	VisitExpr(*expr.value);
-    	ResolveVariable(expr.name, expr.depth, expr.idx);
+    	ResolveAssign(expr.name, expr.depth, expr.idx);
     }
 
     void VisitExpression(StmtExpression& expr) override
@@ -125,7 +382,7 @@ struct Resolver : public ExprVisitor<void>, StmtVisitor<void>
 
     void VisitVar(StmtVar& stmt) override
     {
-    	Declare(*stmt.name);
+    	Declare(*stmt.name, stmt.depth, stmt.idx);
     	if (stmt.init)
     		VisitExpr(*stmt.init);
     	Define(*stmt.name);
@@ -140,26 +397,27 @@ struct Resolver : public ExprVisitor<void>, StmtVisitor<void>
 
     void VisitBlock(StmtBlock& stmt) override
     {
-    	scopes.emplace_back();
+    	BeginScope();
     	ExecuteBlock(stmt.stmts);
-    	scopes.pop_back();
+    	EndScope(stmt.envSlots, stmt.frameSize);
     }
 
     void VisitFunction(StmtFunction& stmt) override
     {
-    	Declare(*stmt.name);
+    	Declare(*stmt.name, stmt.depth, stmt.idx);
+    	DeclareFunction(*stmt.name, (int)stmt.params.size());
     	Define(*stmt.name);
 
     	FunctionType enclosingFunctionType = currentFunction;
     	currentFunction = FunctionType::Function;
-    	scopes.emplace_back();
-    	for (const Token* param : stmt.params)
+    	BeginFunction();
+    	for (int i = 0; i < (int)stmt.params.size(); ++i)
     	{
-    		Declare(*param);
-    		Define(*param);
+    		DeclareParam(*stmt.params[i], i);
+    		Define(*stmt.params[i]);
     	}
     	ExecuteBlock(stmt.body);
-    	scopes.pop_back();
+    	EndFunction(stmt.envSlots, stmt.frameSize);
     	currentFunction = enclosingFunctionType;
     }
 
@@ -178,14 +436,11 @@ struct Resolver : public ExprVisitor<void>, StmtVisitor<void>
 
     void VisitReturn(StmtReturn& stmt) override
     {
-    	if (currentFunction == FunctionType::None)
-    	{
-    		lox_error(*stmt.keyword, "Cannot return at top level");
-    		hadError = true;
-    	}
+    	CheckReturn(*stmt.keyword);
 
     	if (stmt.value)
 	    	VisitExpr(*stmt.value);
+    	stmt.tailCall = IsTailCall(stmt.value && stmt.value->type == ExprType::Call);
     }
 
     void VisitWhile(StmtWhile& stmt) override
@@ -196,14 +451,9 @@ struct Resolver : public ExprVisitor<void>, StmtVisitor<void>
 
     void VisitClass(StmtClass& stmt) override
     {
-    	Declare(*stmt.name);
+    	Declare(*stmt.name, stmt.depth, stmt.idx);
     	Define(*stmt.name);
     }
-
- 	std::vector<ScopeMap> scopes;
-	ScopeMap globalScope;
-	FunctionType currentFunction = FunctionType::None;
-    bool hadError = false;
 };
 
 bool resolver_resolve(StmtPtrList& stmts)
@@ -213,3 +463,121 @@ bool resolver_resolve(StmtPtrList& stmts)
 
 	return !resolver.hadError;
 }
+
+
+struct FlatResolver : public ScopeResolver
+{
+	FlatResolver(FlatAst& ast)
+		: ast(ast)
+	{}
+
+	void ResolveList(uint32_t list)
+	{
+		for (const uint32_t* it = ast.ListBegin(list); it != ast.ListEnd(list); ++it)
+			Resolve(*it);
+	}
+
+	void ResolveFunction(FlatNode& node)
+	{
+		Declare(*ast.GetToken(node), (int&)node.c, (int&)node.d);
+		DeclareFunction(*ast.GetToken(node), (int)ast.ListSize(node.a));
+		Define(*ast.GetToken(node));
+
+		FunctionType enclosingFunctionType = currentFunction;
+		currentFunction = FunctionType::Function;
+		BeginFunction();
+		for (uint32_t i = 0; i < ast.ListSize(node.a); ++i)
+		{
+			const Token& param = ast.tokens[ast.ListBegin(node.a)[i]];
+			DeclareParam(param, (int)i);
+			Define(param);
+		}
+		// the body block shares the scope of the parameters
+		FlatNode& body = ast[node.b];
+		ResolveList(body.a);
+		EndFunction((int&)body.b, (int&)body.c);
+		currentFunction = enclosingFunctionType;
+	}
+
+	void Resolve(NodeIdx idx)
+	{
+		if (idx == NoNode)
+			return;
+
+		FlatNode& node = ast[idx];
+		switch (node.kind)
+		{
+			case FlatKind::Assign:
+				Resolve(node.a);
+				ResolveAssign(ast.GetToken(node), (int&)node.b, (int&)node.c);
+				break;
+			case FlatKind::Binary:
+			case FlatKind::Logical:
+			case FlatKind::Set:
+			case FlatKind::While:
+				Resolve(node.a);
+				Resolve(node.b);
+				break;
+			case FlatKind::Call:
+				if (node.a != NoNode && ast[node.a].kind == FlatKind::Variable)
+				{
+					FlatNode& callee = ast[node.a];
+					ResolveCallee(ast.GetToken(callee), (int&)callee.b, (int&)callee.c, (int&)node.c, (int)ast.ListSize(node.b), ast.GetToken(node));
+				}
+				else
+					Resolve(node.a);
+				ResolveList(node.b);
+				break;
+			case FlatKind::Get:
+			case FlatKind::Grouping:
+			case FlatKind::Unary:
+			case FlatKind::Expression:
+			case FlatKind::Print:
+				Resolve(node.a);
+				break;
+			case FlatKind::Literal:
+				break;
+			case FlatKind::Variable:
+				CheckInitialiser(*ast.GetToken(node));
+				ResolveVariable(ast.GetToken(node), (int&)node.b, (int&)node.c);
+				break;
+			case FlatKind::Block:
+				BeginScope();
+				ResolveList(node.a);
+				EndScope((int&)node.b, (int&)node.c);
+				break;
+			case FlatKind::Function:
+				ResolveFunction(node);
+				break;
+			case FlatKind::If:
+				Resolve(node.a);
+				Resolve(node.b);
+				Resolve(node.c);
+				break;
+			case FlatKind::Return:
+				CheckReturn(*ast.GetToken(node));
+				Resolve(node.a);
+				node.b = IsTailCall(node.a != NoNode && ast[node.a].kind == FlatKind::Call) ? 1 : 0;
+				break;
+			case FlatKind::Var:
+				Declare(*ast.GetToken(node), (int&)node.b, (int&)node.c);
+				Resolve(node.a);
+				Define(*ast.GetToken(node));
+				break;
+			case FlatKind::Class:
+				Declare(*ast.GetToken(node), (int&)node.b, (int&)node.c);
+				Define(*ast.GetToken(node));
+				break;
+		}
+	}
+
+	FlatAst& ast;
+};
+
+bool resolver_resolve(FlatAst& ast)
+{
+	FlatResolver resolver(ast);
+	resolver.ResolveList(ast.program);
+
+	return !resolver.hadError;
+}
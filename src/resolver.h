@@ -1,4 +1,7 @@
 #pragma once
 #include "ast.h"
 
+struct FlatAst;
+
 bool resolver_resolve(StmtPtrList& stmts);
+bool resolver_resolve(FlatAst& ast);
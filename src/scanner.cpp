@@ -1,6 +1,15 @@
 #include "scanner.h"
 #include "lox.h"
+#include "source.h"
+#include "symbols.h"
 #include <cassert>
+#include <cstring>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 const char* tokentype_to_string(const TokenType token)
 {
@@ -49,48 +58,200 @@ const char* tokentype_to_string(const TokenType token)
     }
 }
 
-struct Keyword
+int token_line(const Token& token)
 {
-    const char* keyword;
-    TokenType type;
+    return source_line(token.start);
+}
+
+const char* token_text(const Token& token)
+{
+    return source_text(token.start);
+}
+
+// Character classes used to dispatch ScanTokens() with a single table lookup
+enum CharClass : unsigned char
+{
+    CC_INVALID, CC_SPACE, CC_DIGIT, CC_ALPHA, CC_SINGLE, CC_OPERATOR, CC_SLASH, CC_QUOTE
+};
+
+struct CharTables
+{
+    CharClass charClass[256];
+    TokenType singleToken[256];// token for CC_SINGLE, or the one character form of CC_OPERATOR
+    TokenType equalToken[256];// two character form of CC_OPERATOR when followed by '='
+
+    CharTables()
+    {
+        for (int i = 0; i<256; ++i)
+        {
+            charClass[i] = CC_INVALID;
+            singleToken[i] = TokenType::END;
+            equalToken[i] = TokenType::END;
+        }
+        for (int c = '0'; c <= '9'; ++c) charClass[c] = CC_DIGIT;
+        for (int c = 'a'; c <= 'z'; ++c) charClass[c] = CC_ALPHA;
+        for (int c = 'A'; c <= 'Z'; ++c) charClass[c] = CC_ALPHA;
+        charClass['_'] = CC_ALPHA;
+        charClass[' '] = charClass['\r'] = charClass['\t'] = charClass['\n'] = CC_SPACE;
+        charClass['/'] = CC_SLASH;
+        charClass['"'] = CC_QUOTE;
+
+        Single('(', TokenType::LEFT_PAREN); Single(')', TokenType::RIGHT_PAREN);
+        Single('{', TokenType::LEFT_BRACE); Single('}', TokenType::RIGHT_BRACE);
+        Single(',', TokenType::COMMA); Single('.', TokenType::DOT);
+        Single('-', TokenType::MINUS); Single('+', TokenType::PLUS);
+        Single(';', TokenType::SEMICOLON); Single('*', TokenType::STAR);
+
+        Operator('!', TokenType::BANG, TokenType::BANG_EQUAL);
+        Operator('=', TokenType::EQUAL, TokenType::EQUAL_EQUAL);
+        Operator('<', TokenType::LESS, TokenType::LESS_EQUAL);
+        Operator('>', TokenType::GREATER, TokenType::GREATER_EQUAL);
+    }
+
+    void Single(unsigned char c, TokenType type)
+    {
+        charClass[c] = CC_SINGLE;
+        singleToken[c] = type;
+    }
+
+    void Operator(unsigned char c, TokenType type, TokenType typeEqual)
+    {
+        charClass[c] = CC_OPERATOR;
+        singleToken[c] = type;
+        equalToken[c] = typeEqual;
+    }
 };
 
-Keyword g_keywords[] = {
-    { "and",    TokenType::AND },
-    { "class",  TokenType::CLASS },
-    { "else",   TokenType::ELSE },
-    { "false",  TokenType::FALSE },
-    { "for",    TokenType::FOR },
-    { "fun",    TokenType::FUN },
-    { "if",     TokenType::IF },
-    { "nil",    TokenType::NIL },
-    { "or",     TokenType::OR },
-    { "print",  TokenType::PRINT },
-    { "return", TokenType::RETURN },
-    { "super",  TokenType::SUPER },
-    { "this",   TokenType::THIS },
-    { "true",   TokenType::TRUE },
-    { "var",    TokenType::VAR },
-    { "while",  TokenType::WHILE }
+static const CharTables g_tables;
+
+static inline bool IsKeyword(const char* str, const char* keyword, int len)
+{
+    return memcmp(str + 1, keyword + 1, len - 1) == 0;
+}
+
+// Keyword lookup switching on length and first character so that at most one
+// compare is made per identifier.
+static TokenType KeywordType(const char* str, int len)
+{
+    switch (len)
+    {
+        case 2:
+            switch (str[0])
+            {
+                case 'i': if (IsKeyword(str, "if", 2)) return TokenType::IF; break;
+                case 'o': if (IsKeyword(str, "or", 2)) return TokenType::OR; break;
+            }
+            break;
+        case 3:
+            switch (str[0])
+            {
+                case 'a': if (IsKeyword(str, "and", 3)) return TokenType::AND; break;
+                case 'f':
+                    if (IsKeyword(str, "for", 3)) return TokenType::FOR;
+                    if (IsKeyword(str, "fun", 3)) return TokenType::FUN;
+                    break;
+                case 'n': if (IsKeyword(str, "nil", 3)) return TokenType::NIL; break;
+                case 'v': if (IsKeyword(str, "var", 3)) return TokenType::VAR; break;
+            }
+            break;
+        case 4:
+            switch (str[0])
+            {
+                case 'e': if (IsKeyword(str, "else", 4)) return TokenType::ELSE; break;
+                case 't':
+                    if (IsKeyword(str, "this", 4)) return TokenType::THIS;
+                    if (IsKeyword(str, "true", 4)) return TokenType::TRUE;
+                    break;
+            }
+            break;
+        case 5:
+            switch (str[0])
+            {
+                case 'c': if (IsKeyword(str, "class", 5)) return TokenType::CLASS; break;
+                case 'f': if (IsKeyword(str, "false", 5)) return TokenType::FALSE; break;
+                case 'p': if (IsKeyword(str, "print", 5)) return TokenType::PRINT; break;
+                case 's': if (IsKeyword(str, "super", 5)) return TokenType::SUPER; break;
+                case 'w': if (IsKeyword(str, "while", 5)) return TokenType::WHILE; break;
+            }
+            break;
+        case 6:
+            if (str[0] == 'r' && IsKeyword(str, "return", 6)) return TokenType::RETURN;
+            break;
+    }
+    return TokenType::IDENTIFIER;
+}
+
+// Skips a run of blank characters, returning the first non blank character at
+// or after str.
+static inline const char* SkipWhitespace(const char* str, const char* end)
+{
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - str >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)str);
+        __m128i isBlank = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, newline)));
+        unsigned blankMask = (unsigned)_mm_movemask_epi8(isBlank);
+        if (blankMask != 0xFFFF)
+            return str + __builtin_ctz(~blankMask);
+        str += 16;
+    }
+#endif
+    while (str < end && g_tables.charClass[(unsigned char)*str] == CC_SPACE)
+        ++str;
+    return str;
+}
+
+struct ScanError
+{
+    int line;
+    const char* message;
+};
+
+// Identifiers seen by one chunk of a parallel scan. They are interned locally
+// so worker threads never touch the global symbol table, then remapped to
+// global symbol ids when the chunks are stitched together.
+struct ChunkSymbols
+{
+    std::unordered_map<std::string, int> ids;
+    std::vector<const std::string*> names;
+
+    int Intern(const char* name, int length)
+    {
+        auto item = ids.emplace(std::string(name, length), (int)names.size());
+        if (item.second)
+            names.push_back(&item.first->first);
+        return item.first->second;
+    }
 };
 
 struct Scanner
 {
     const char* m_source;
     std::vector<Token>& m_tokens;
-    int m_start, m_end, m_current, m_line, m_sourceLen;
+    int m_start, m_end, m_current, m_base;
+    int m_openString;// start of a string still open when the end was reached, or -1
+    ChunkSymbols* m_symbols;// null when interning straight into the global symbol table
+    std::vector<ScanError>* m_errors;// null when reporting errors immediately
     
-    Scanner(const char* source, int sourceLen, std::vector<Token>& tokens)
+    Scanner(const char* source, int begin, int end, int base, std::vector<Token>& tokens)
     : m_source(source)
     , m_tokens(tokens)
-    , m_start(0)
-    , m_end(0)
-    , m_current(0)
-    , m_line(1)
-    , m_sourceLen(sourceLen)
+    , m_start(begin)
+    , m_end(end)
+    , m_current(begin)
+    , m_base(base)
+    , m_openString(-1)
+    , m_symbols(nullptr)
+    , m_errors(nullptr)
     {}
     
-    inline bool IsAtEnd() { return m_current >= m_sourceLen; }
+    inline bool IsAtEnd() { return m_current >= m_end; }
     
     char Advance()
     {
@@ -105,7 +266,7 @@ struct Scanner
     
     char PeekNext()
     {
-        if (m_current + 1 >= m_sourceLen) return '\0';
+        if (m_current + 1 >= m_end) return '\0';
         return m_source[m_current + 1];
     }
     
@@ -116,146 +277,237 @@ struct Scanner
         ++m_current;
         return true;
     }
+
+    void Error(int offset, const char* message)
+    {
+        int line = source_line(m_base + offset);
+        if (m_errors)
+            m_errors->push_back(ScanError{ line, message });
+        else
+            lox_error(line, message);
+    }
     
     Token& AddToken(TokenType type)
     {
         m_tokens.push_back(Token());
         Token& tok = m_tokens[m_tokens.size() - 1];
         tok.type = type;
-        int len = m_current - m_start;
-        if (len >= 32) len = 31;
-        assert(len > 0);
-        for (int i = 0; i<len; i++)
-            tok.lexeme[i] = m_source[m_start + i];
-        tok.lexeme[len] = '\0';
-        tok.line = m_line;
+        tok.start = m_base + m_start;
+        tok.length = m_current - m_start;
+        tok.index = 0;
+        assert(tok.length > 0);
         return tok;
     }
     
     void ScanString()
     {
-        while (Peek() != '"' && !IsAtEnd())
-        {
-            if (Peek() == '\n') ++m_line;
-            Advance();
-        }
+        const char* body = m_source + m_current;
+        const char* quote = (const char*)memchr(body, '"', m_end - m_current);
+        m_current = quote ? quote - m_source : m_end;
         
         if (IsAtEnd())
         {
-            lox_error(m_line, "Unterminated string");
+            m_openString = m_start;
+            Error(m_current, "Unterminated string");
             return;
         }
         
         Advance();
-        AddToken(TokenType::STRING).stringLiteral = std::string(m_source + m_start + 1, m_current - m_start - 2);
+        AddToken(TokenType::STRING);
     }
     
-    inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
-    
     void Number()
     {
-        while (IsDigit(Peek())) Advance();
-        if (Peek() == '.' && IsDigit(PeekNext()))
+        int value = m_source[m_start] - '0';
+        while (g_tables.charClass[(unsigned char)Peek()] == CC_DIGIT)
+            value = value * 10 + (Advance() - '0');
+        if (Peek() == '.' && g_tables.charClass[(unsigned char)PeekNext()] == CC_DIGIT)
         {
             Advance();//consume .
-            while (IsDigit(Peek())) Advance();
+            while (g_tables.charClass[(unsigned char)Peek()] == CC_DIGIT) Advance();
         }
         
-        AddToken(TokenType::NUMBER).numberLiteral = atoi(&m_source[m_start]);
+        AddToken(TokenType::NUMBER).index = value;
     }
     
-    inline bool IsLetter(char c) { return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'); }
-    inline bool IsLetterOrDigit(char c) { return IsDigit(c) || IsLetter(c); }
-    
     void Identifier()
     {
-        while (IsLetterOrDigit(Peek())) Advance();
-        
-        TokenType type = TokenType::IDENTIFIER;
-        for (const Keyword& keyw : g_keywords)
+        for (;;)
         {
-            const char* keyword = keyw.keyword;
-            int i = 0;
-            while (*keyword != '\0' && m_source[m_start + i] == *keyword && m_start + i < m_current)
-            {
-                ++keyword;
-                ++i;
-            }
-            if (*keyword == '\0' && m_start + i == m_current)
-            {
-                type = keyw.type;
+            CharClass cc = g_tables.charClass[(unsigned char)Peek()];
+            if (cc != CC_ALPHA && cc != CC_DIGIT)
                 break;
-            }
+            Advance();
         }
+        
+        const char* name = m_source + m_start;
+        int length = m_current - m_start;
+        TokenType type = KeywordType(name, length);
         Token& token = AddToken(type);
         if (type == TokenType::IDENTIFIER)
-            token.stringLiteral = std::string(m_source + m_start, m_current - m_start);
+            token.index = m_symbols ? m_symbols->Intern(name, length) : symbol_intern(name, length);
     }
     
     void ScanTokens()
     {
+        const char* end = m_source + m_end;
         while (!IsAtEnd())
         {
             m_start = m_current;
-            char c = Advance();
-            switch (c)
+            unsigned char c = Advance();
+            switch (g_tables.charClass[c])
             {
-                case '(': AddToken(TokenType::LEFT_PAREN); break;
-                case ')': AddToken(TokenType::RIGHT_PAREN); break;
-                case '{': AddToken(TokenType::LEFT_BRACE); break;
-                case '}': AddToken(TokenType::RIGHT_BRACE); break;
-                case ',': AddToken(TokenType::COMMA); break;
-                case '.': AddToken(TokenType::DOT); break;
-                case '-': AddToken(TokenType::MINUS); break;
-                case '+': AddToken(TokenType::PLUS); break;
-                case ';': AddToken(TokenType::SEMICOLON); break;
-                case '*': AddToken(TokenType::STAR); break;
-                case '!': AddToken(Match('=') ? TokenType::BANG_EQUAL : TokenType::BANG); break;
-                case '=': AddToken(Match('=') ? TokenType::EQUAL_EQUAL : TokenType::EQUAL); break;
-                case '<': AddToken(Match('=') ? TokenType::LESS_EQUAL : TokenType::LESS); break;
-                case '>': AddToken(Match('=') ? TokenType::GREATER_EQUAL : TokenType::GREATER); break;
-                case '/':
+                case CC_SINGLE:
+                    AddToken(g_tables.singleToken[c]);
+                    break;
+                case CC_OPERATOR:
+                    AddToken(Match('=') ? g_tables.equalToken[c] : g_tables.singleToken[c]);
+                    break;
+                case CC_SLASH:
                     if (Match('/'))
                     {
                         //Match comment
-                        while (Peek() != '\n' && !IsAtEnd()) Advance();
+                        const char* newline = (const char*)memchr(m_source + m_current, '\n', m_end - m_current);
+                        m_current = newline ? newline - m_source : m_end;
                     }
                     else
                     {
                         AddToken(TokenType::SLASH);
                     }
                     break;
-                case ' ':
-                case '\r':
-                case '\t'://Ignore whitespace
-                    break;
-                case '\n':
-                    m_line++;
+                case CC_SPACE://Ignore whitespace
+                    m_current = SkipWhitespace(m_source + m_start, end) - m_source;
                     break;
-                case '"': ScanString(); break;
+                case CC_QUOTE: ScanString(); break;
+                case CC_DIGIT: Number(); break;
+                case CC_ALPHA: Identifier(); break;
                 default:
-                    if (IsDigit(c))
-                        Number();
-                    else if (IsLetter(c) || c == '_')
-                        Identifier();
-                    else
-                        lox_error(m_line, "Unexpected character");
+                    Error(m_start, "Unexpected character");
                     break;
             }
         }
-        
+    }
+
+    void AddEnd()
+    {
         m_tokens.push_back(Token());
         Token& tok = m_tokens[m_tokens.size()-1];
         tok.type = TokenType::END;
-        tok.lexeme[0] = '\0';
-        tok.stringLiteral = std::string();
-        tok.numberLiteral = 0;
-        tok.line = m_line;
+        tok.start = m_base + m_end;
+        tok.length = 0;
+        tok.index = 0;
     }
 };
 
-void scanner_scan(const char* source, int sourceLen, std::vector<Token>& tokens)
+// Sources smaller than this are not worth handing to worker threads
+static const int ParallelScanMinBytes = 1 << 20;
+static const int ChunksPerThread = 4;
+
+struct ScanChunk
 {
-    Scanner scanner(source, sourceLen, tokens);
-    scanner.ScanTokens();
+    int begin, end;
+    std::vector<Token> tokens;
+    std::vector<ScanError> errors;
+    ChunkSymbols symbols;
+    int openString;
+
+    void Scan(const char* source, int base, int from)
+    {
+        tokens.clear();
+        errors.clear();
+        symbols = ChunkSymbols();
+        Scanner scanner(source, from, end, base, tokens);
+        scanner.m_symbols = &symbols;
+        scanner.m_errors = &errors;
+        scanner.ScanTokens();
+        openString = scanner.m_openString;
+    }
+};
+
+// Splits the source into chunks that each start at the beginning of a line.
+// Comments never span lines, so the only construct that can cross a chunk
+// boundary is a multi-line string; chunks are scanned speculatively as if
+// they start outside a string and are rescanned while stitching if the
+// previous chunk turns out to have ended inside one.
+static void ScanParallel(const char* source, int sourceLen, int base, int threadCount, std::vector<Token>& tokens)
+{
+    int chunkCount = threadCount * ChunksPerThread;
+    int chunkSize = (sourceLen + chunkCount - 1) / chunkCount;
+    std::vector<ScanChunk> chunks;
+    int begin = 0;
+    while (begin < sourceLen)
+    {
+        int end = begin + chunkSize;
+        if (end >= sourceLen)
+            end = sourceLen;
+        else
+        {
+            const char* newline = (const char*)memchr(source + end, '\n', sourceLen - end);
+            end = newline ? (int)(newline - source) + 1 : sourceLen;
+        }
+        chunks.emplace_back();
+        chunks.back().begin = begin;
+        chunks.back().end = end;
+        begin = end;
+    }
+
+    std::atomic<int> nextChunk(0);
+    auto worker = [&]()
+    {
+        for (int i = nextChunk++; i < (int)chunks.size(); i = nextChunk++)
+            chunks[i].Scan(source, base, chunks[i].begin);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    size_t tokenCount = 1;
+    for (const ScanChunk& chunk : chunks)
+        tokenCount += chunk.tokens.size();
+    tokens.reserve(tokens.size() + tokenCount);
+
+    std::vector<int> symbolIds;
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        ScanChunk& chunk = chunks[i];
+        if (i > 0 && chunks[i - 1].openString >= 0)
+        {
+            // the previous chunk ended inside a string, so this chunk was
+            // scanned in the wrong state; resume from the string's opening quote
+            chunk.Scan(source, base, chunks[i - 1].openString);
+        }
+        bool isLast = i + 1 == chunks.size();
+        if (chunk.openString >= 0 && !isLast)
+            chunk.errors.pop_back();// the string is closed by a later chunk
+        for (const ScanError& error : chunk.errors)
+            lox_error(error.line, error.message);
+
+        symbolIds.resize(chunk.symbols.names.size());
+        for (size_t s = 0; s < symbolIds.size(); ++s)
+            symbolIds[s] = symbol_intern(chunk.symbols.names[s]->c_str(), (int)chunk.symbols.names[s]->size());
+        for (Token& token : chunk.tokens)
+        {
+            if (token.type == TokenType::IDENTIFIER)
+                token.index = symbolIds[token.index];
+            tokens.push_back(token);
+        }
+        std::vector<Token>().swap(chunk.tokens);
+    }
+}
+
+void scanner_scan(const char* source, int sourceLen, std::vector<Token>& tokens, int threadCount, int firstLine)
+{
+    int base = source_add(source, sourceLen, firstLine);
+    if (threadCount <= 0)
+        threadCount = sourceLen >= ParallelScanMinBytes ? (int)std::thread::hardware_concurrency() : 1;
+
+    Scanner scanner(source, 0, sourceLen, base, tokens);
+    if (threadCount > 1)
+        ScanParallel(source, sourceLen, base, threadCount, tokens);
+    else
+        scanner.ScanTokens();
+    scanner.AddEnd();
 }
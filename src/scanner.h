@@ -25,10 +25,16 @@ const char* tokentype_to_string(const TokenType token);
 struct Token
 {
     TokenType type;
-    char lexeme[32];
-    int numberLiteral;
-    std::string stringLiteral;
-    int line;
+    int start;// offset registered with source_add, see source.h
+    int length;
+    int index;// symbol id for IDENTIFIER, value for NUMBER
 };
 
-void scanner_scan(const char* source, int sourceLen, std::vector<Token>& tokens);
+int token_line(const Token& token);
+const char* token_text(const Token& token);
+
+// threadCount of 0 picks automatically: large sources are split into line
+// aligned chunks scanned on worker threads, producing the same tokens and
+// errors as a serial scan. firstLine numbers the source's lines when it is a
+// fragment of a larger document.
+void scanner_scan(const char* source, int sourceLen, std::vector<Token>& tokens, int threadCount = 0, int firstLine = 1);
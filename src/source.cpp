@@ -0,0 +1,76 @@
+#include "source.h"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+struct Source
+{
+    const char* text;
+    int base, length;
+    int firstLine;
+    std::vector<int> lineStarts;// offset of the first character of each line, relative to base
+};
+
+static std::vector<Source> g_sources;
+static std::vector<SourceRemoved> g_removeCallbacks;
+
+static Source& FindSource(int offset)
+{
+    // sources are registered in increasing base order
+    auto it = std::upper_bound(g_sources.begin(), g_sources.end(), offset, [](int offset, const Source& source) { return offset < source.base; });
+    return *(it - 1);
+}
+
+// Each source takes length + 1 offsets, the gap keeping the END token of one
+// source from aliasing the next. A new source goes in the first gap left by
+// removed sources that fits it, so offsets stay bounded by the live sources.
+int source_add(const char* text, int length, int firstLine)
+{
+    int base = 0;
+    auto it = g_sources.begin();
+    for (; it != g_sources.end() && it->base - base < length + 1; ++it)
+        base = it->base + it->length + 1;
+
+    Source& source = *g_sources.insert(it, Source());
+    source.text = text;
+    source.base = base;
+    source.length = length;
+    source.firstLine = firstLine;
+
+    source.lineStarts.push_back(0);
+    const char* end = text + length;
+    for (const char* str = text; (str = (const char*)memchr(str, '\n', end - str)) != nullptr; )
+        source.lineStarts.push_back(++str - text);
+    return source.base;
+}
+
+void source_remove(int offset)
+{
+    Source& source = FindSource(offset);
+    for (SourceRemoved callback : g_removeCallbacks)
+        callback(source.base, source.length);
+    g_sources.erase(g_sources.begin() + (&source - g_sources.data()));
+}
+
+void source_on_remove(SourceRemoved callback)
+{
+    g_removeCallbacks.push_back(callback);
+}
+
+const char* source_text(int offset)
+{
+    const Source& source = FindSource(offset);
+    return source.text + (offset - source.base);
+}
+
+int source_line(int offset)
+{
+    const Source& source = FindSource(offset);
+    auto it = std::upper_bound(source.lineStarts.begin(), source.lineStarts.end(), offset - source.base);
+    return source.firstLine - 1 + (int)(it - source.lineStarts.begin());
+}
+
+void source_set_first_line(int offset, int firstLine)
+{
+    FindSource(offset).firstLine = firstLine;
+}
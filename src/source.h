@@ -0,0 +1,22 @@
+#pragma once
+
+// Every buffer handed to the scanner is registered here. Token offsets are
+// positions in the combined space of all registered buffers, so a Token alone
+// is enough to recover its text and line number when reporting errors.
+// Registered buffers must outlive any tokens scanned from them, or be removed
+// before they are freed; the offsets of a removed buffer are reused.
+
+int source_add(const char* text, int length, int firstLine = 1);
+// Unregisters the source containing offset
+void source_remove(int offset);
+
+// Called with the offsets of each source as it is removed, so that caches
+// keyed on offsets can drop their entries before the offsets are reused
+typedef void (*SourceRemoved)(int base, int length);
+void source_on_remove(SourceRemoved callback);
+const char* source_text(int offset);
+int source_line(int offset);
+
+// Numbers the lines of the source containing offset from firstLine instead of
+// 1, for buffers holding a fragment of a larger document.
+void source_set_first_line(int offset, int firstLine);
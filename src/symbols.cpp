@@ -0,0 +1,48 @@
+#include "symbols.h"
+#include <unordered_map>
+#include <deque>
+#include <vector>
+
+struct SymbolTable
+{
+    std::deque<std::string> names;// deque keeps references returned by symbol_name stable
+    std::unordered_map<std::string, int> ids;
+    std::vector<int> globalSlots;// by symbol id, -1 until assigned
+    int globalCount = 0;
+};
+
+static SymbolTable& GetSymbols()
+{
+    static SymbolTable symbols;
+    return symbols;
+}
+
+int symbol_intern(const char* name, int length)
+{
+    SymbolTable& symbols = GetSymbols();
+    std::string key(name, length);
+    auto item = symbols.ids.find(key);
+    if (item != symbols.ids.end())
+        return item->second;
+
+    int id = (int)symbols.names.size();
+    symbols.names.push_back(key);
+    symbols.ids.emplace(std::move(key), id);
+    return id;
+}
+
+const std::string& symbol_name(int id)
+{
+    return GetSymbols().names[id];
+}
+
+int symbol_global_slot(int id)
+{
+    SymbolTable& symbols = GetSymbols();
+    if (id >= (int)symbols.globalSlots.size())
+        symbols.globalSlots.resize(symbols.names.size(), -1);
+    int& slot = symbols.globalSlots[id];
+    if (slot < 0)
+        slot = symbols.globalCount++;
+    return slot;
+}
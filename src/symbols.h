@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+
+// Global table of interned identifier names. Each distinct name is given a
+// dense integer id the first time it is seen.
+
+int symbol_intern(const char* name, int length);
+const std::string& symbol_name(int id);
+
+// Slot of a global variable in the global environment. Slots are handed out
+// densely the first time a name is resolved as a global or registered as a
+// native, and stay the same for the rest of the process, so REPL lines and
+// cached programs compiled separately agree on them.
+int symbol_global_slot(int id);